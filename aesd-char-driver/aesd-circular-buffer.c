@@ -10,14 +10,259 @@
 
 #ifdef __KERNEL__
 #include <linux/string.h>
-#include <linux/mutex.h>
 #else
 #include <string.h>
+#ifdef AESD_CIRCULAR_BUFFER_LOCKFREE
+#include <sched.h>
+#else
 #include <pthread.h>
 #endif
+#endif
 
 #include "aesd-circular-buffer.h"
 
+/*
+ * aesd_circular_buffer_lock/unlock rodean los cambios del productor.
+ * aesd_circular_buffer_read_begin/read_retry rodean las lecturas:
+ *   do { seq = read_begin(b); ...leer... } while (read_retry(b, seq));
+ * Con mutex read_begin lo toma, read_retry lo suelta y nunca repite.
+ * AESD_LOAD/AESD_STORE acceden a los campos que leen los lectores, y
+ * slot_load/slot_store copian una entrada del array.
+ */
+#if defined(__KERNEL__)
+/* En el kernel el driver serializa a los escritores con su propio mutex y los
+ * lectores validan con un seqcount, así que el buffer no toma ningún lock.
+ */
+#define aesd_circular_buffer_lock(buffer) ((void)(buffer))
+#define aesd_circular_buffer_unlock(buffer) ((void)(buffer))
+#define aesd_circular_buffer_read_begin(buffer) ((void)(buffer), 0u)
+#define aesd_circular_buffer_read_retry(buffer, seq) ((void)(buffer), (void)(seq), false)
+#elif defined(AESD_CIRCULAR_BUFFER_LOCKFREE)
+/* Un solo productor: nadie más escribe seq, basta con publicarlo. La barrera
+ * release tras el valor impar impide que los cambios se adelanten a él.
+ * Los lectores no leen los índices del buffer: el productor los modifica sin
+ * abrir ninguna ventana y al terminar publica una copia en heads[], que los
+ * lectores copian sin esperarle. Cada entrada tiene su propio seq: un lector
+ * valida la entrada que encuentra contra la copia de la cabecera y sólo
+ * repite si el productor ha reutilizado justo esa entrada.
+ */
+#define AESD_LOAD(field) __atomic_load_n(&(field), __ATOMIC_RELAXED)
+#define AESD_STORE(field, value) __atomic_store_n(&(field), (value), __ATOMIC_RELAXED)
+
+static inline void aesd_seq_write_begin(unsigned int *seq)
+{
+    __atomic_store_n(seq, *seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void aesd_seq_write_end(unsigned int *seq)
+{
+    __atomic_store_n(seq, *seq + 1, __ATOMIC_RELEASE);
+}
+
+// Vueltas con pause antes de ceder la CPU al productor
+#define AESD_SEQ_SPINS 64
+
+static inline unsigned int aesd_seq_read_begin(const unsigned int *seq)
+{
+    unsigned int value;
+    unsigned int spins = 0;
+
+    /* El productor nunca espera y termina enseguida si está corriendo; si
+     * sigue a medias tras unas vueltas es que lo han desalojado
+     */
+    while ((value = __atomic_load_n(seq, __ATOMIC_ACQUIRE)) & 1)
+    {
+        if (++spins < AESD_SEQ_SPINS)
+        {
+#if defined(__x86_64__) || defined(__i386__)
+            __builtin_ia32_pause();
+#endif
+        }
+        else
+        {
+            spins = 0;
+            sched_yield();
+        }
+    }
+    return value;
+}
+
+static inline bool aesd_seq_read_retry(const unsigned int *seq, unsigned int value)
+{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(seq, __ATOMIC_RELAXED) != value;
+}
+
+// El productor no tiene a quién excluir: al terminar publica la cabecera
+#define aesd_circular_buffer_lock(buffer) ((void)(buffer))
+#define aesd_circular_buffer_unlock(buffer) aesd_circular_buffer_publish(buffer)
+/* Antes de reutilizar la entrada más antigua se publica que ya no está: una
+ * cabecera publicada nunca apunta a una entrada a medio reescribir, y un lector
+ * que encuentra una entrada reutilizada tiene una cabecera más nueva que leer
+ */
+#define aesd_circular_buffer_evicted(buffer) aesd_circular_buffer_publish(buffer)
+// La validación va dentro de cada lectura (cabecera y entrada por separado)
+#define aesd_circular_buffer_read_begin(buffer) ((void)(buffer), 0u)
+#define aesd_circular_buffer_read_retry(buffer, seq) ((void)(buffer), (void)(seq), false)
+// Sin lock la entrada puede haberse reutilizado desde que se leyó la cabecera
+#define aesd_circular_buffer_slot_reused(reused) (reused)
+
+static inline void aesd_circular_buffer_slot_store(struct aesd_buffer_entry *slot, const char *buffptr, size_t size,
+                                                   size_t end_offs)
+{
+    aesd_seq_write_begin(&slot->seq);
+    AESD_STORE(slot->buffptr, buffptr);
+    AESD_STORE(slot->size, size);
+    AESD_STORE(slot->end_offs, end_offs);
+    aesd_seq_write_end(&slot->seq);
+}
+
+static inline void aesd_circular_buffer_slot_load(const struct aesd_buffer_entry *slot, struct aesd_buffer_entry *copy)
+{
+    unsigned int seq;
+
+    do
+    {
+        seq = aesd_seq_read_begin(&slot->seq);
+        copy->buffptr = AESD_LOAD(slot->buffptr);
+        copy->size = AESD_LOAD(slot->size);
+        copy->end_offs = AESD_LOAD(slot->end_offs);
+    } while (aesd_seq_read_retry(&slot->seq, seq));
+}
+#else
+#define aesd_circular_buffer_lock(buffer) pthread_mutex_lock(&(buffer)->lock)
+#define aesd_circular_buffer_unlock(buffer) pthread_mutex_unlock(&(buffer)->lock)
+#define aesd_circular_buffer_read_begin(buffer) ((void)pthread_mutex_lock(&(buffer)->lock), 0u)
+#define aesd_circular_buffer_read_retry(buffer, seq) ((void)(seq), (void)pthread_mutex_unlock(&(buffer)->lock), false)
+#endif
+
+#ifndef AESD_LOAD
+// Con mutex o en el kernel la lectura entera ya está protegida: accesos normales
+#define AESD_LOAD(field) (field)
+#define AESD_STORE(field, value) ((field) = (value))
+#define aesd_circular_buffer_evicted(buffer) ((void)(buffer))
+#define aesd_circular_buffer_slot_reused(reused) ((void)(reused), false)
+
+static inline void aesd_circular_buffer_slot_store(struct aesd_buffer_entry *slot, const char *buffptr, size_t size,
+                                                   size_t end_offs)
+{
+    slot->buffptr = buffptr;
+    slot->size = size;
+    slot->end_offs = end_offs;
+}
+
+static inline void aesd_circular_buffer_slot_load(const struct aesd_buffer_entry *slot, struct aesd_buffer_entry *copy)
+{
+    copy->buffptr = slot->buffptr;
+    copy->size = slot->size;
+    copy->end_offs = slot->end_offs;
+}
+#endif
+
+// Número de entradas válidas en el buffer
+static inline size_t aesd_circular_buffer_entry_count(const struct aesd_circular_buffer *buffer)
+{
+    if (buffer->full)
+        return buffer->capacity;
+    return (buffer->in_offs + buffer->capacity - buffer->out_offs) % buffer->capacity;
+}
+
+// Entrada número 'index' en orden de escritura (0 = la más antigua)
+static inline struct aesd_buffer_entry *aesd_circular_buffer_entry_at(struct aesd_circular_buffer *buffer, size_t index)
+{
+    return &buffer->entry[(buffer->out_offs + index) % buffer->capacity];
+}
+
+#if !defined(__KERNEL__) && defined(AESD_CIRCULAR_BUFFER_LOCKFREE)
+// Publica la cabecera en la siguiente copia de heads[], que ningún lector está leyendo
+static void aesd_circular_buffer_publish(struct aesd_circular_buffer *buffer)
+{
+    unsigned int idx = (buffer->head_idx + 1) % AESD_CIRCULAR_BUFFER_HEADS;
+    struct aesd_circular_buffer_head *head = &buffer->heads[idx];
+
+    aesd_seq_write_begin(&head->seq);
+    AESD_STORE(head->out_offs, buffer->out_offs);
+    AESD_STORE(head->count, aesd_circular_buffer_entry_count(buffer));
+    AESD_STORE(head->head_offs, buffer->head_offs);
+    AESD_STORE(head->base_offs, buffer->base_offs);
+    aesd_seq_write_end(&head->seq);
+    // Las entradas y la copia quedan escritas antes de que un lector la elija
+    __atomic_store_n(&buffer->head_idx, idx, __ATOMIC_RELEASE);
+}
+
+// Copia coherente de la última cabecera publicada
+static void aesd_circular_buffer_read_head(struct aesd_circular_buffer *buffer, struct aesd_circular_buffer_head *head)
+{
+    const struct aesd_circular_buffer_head *src;
+    unsigned int seq;
+
+    do
+    {
+        src = &buffer->heads[__atomic_load_n(&buffer->head_idx, __ATOMIC_ACQUIRE)];
+        seq = aesd_seq_read_begin(&src->seq);
+        head->out_offs = AESD_LOAD(src->out_offs);
+        head->count = AESD_LOAD(src->count);
+        head->head_offs = AESD_LOAD(src->head_offs);
+        head->base_offs = AESD_LOAD(src->base_offs);
+        // Sólo cambia si el productor ha dado la vuelta a heads[] mientras tanto
+    } while (aesd_seq_read_retry(&src->seq, seq));
+}
+#else
+// Con mutex o en el kernel la cabecera se lee directamente
+static void aesd_circular_buffer_read_head(struct aesd_circular_buffer *buffer, struct aesd_circular_buffer_head *head)
+{
+    head->out_offs = buffer->out_offs;
+    head->count = aesd_circular_buffer_entry_count(buffer);
+    head->head_offs = buffer->head_offs;
+    head->base_offs = buffer->base_offs;
+}
+#endif
+
+// Entrada que contiene char_offset, copiada en *copy_rtn; NULL si está fuera del buffer
+static struct aesd_buffer_entry *aesd_circular_buffer_search(struct aesd_circular_buffer *buffer, size_t char_offset,
+                                                             struct aesd_buffer_entry *copy_rtn,
+                                                             size_t *entry_offset_byte_rtn)
+{
+    struct aesd_circular_buffer_head head;
+    struct aesd_buffer_entry *found;
+    size_t start;
+    size_t lo;
+    size_t hi;
+
+    do
+    {
+        aesd_circular_buffer_read_head(buffer, &head);
+
+        // Fuera de rango: no hace falta buscar
+        if (char_offset >= head.head_offs - head.base_offs)
+            return NULL;
+
+        /* Búsqueda binaria sobre los totales acumulados (end_offs), que crecen
+         * en orden de escritura: primera entrada cuyo final supera char_offset
+         */
+        lo = 0;
+        hi = head.count - 1;
+        while (lo < hi)
+        {
+            size_t mid = lo + (hi - lo) / 2;
+            if (AESD_LOAD(buffer->entry[(head.out_offs + mid) % buffer->capacity].end_offs) - head.base_offs > char_offset)
+                hi = mid;
+            else
+                lo = mid + 1;
+        }
+
+        found = &buffer->entry[(head.out_offs + lo) % buffer->capacity];
+        aesd_circular_buffer_slot_load(found, copy_rtn);
+        start = copy_rtn->end_offs - copy_rtn->size;
+        // Los bytes de cada posición están en una sola entrada: si ésta no los contiene, se repite
+    } while (aesd_circular_buffer_slot_reused(head.base_offs + char_offset < start ||
+                                              head.base_offs + char_offset >= copy_rtn->end_offs));
+
+    *entry_offset_byte_rtn = head.base_offs + char_offset - start;
+    return found;
+}
+
 /**
  * @param buffer the buffer to search for corresponding offset.  Any necessary locking must be performed by caller.
  * @param char_offset the position to search for in the buffer list, describing the zero referenced
@@ -31,56 +276,215 @@
 struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct aesd_circular_buffer *buffer,
                                                                           size_t char_offset, size_t *entry_offset_byte_rtn)
 {
-    /**
-     * TODO: implement per description
-     */
-    if (buffer != NULL && entry_offset_byte_rtn != NULL)
+    struct aesd_buffer_entry *found;
+    struct aesd_buffer_entry copy;
+    size_t entry_offset_byte = 0;
+    unsigned int seq;
+
+    if (buffer == NULL || entry_offset_byte_rtn == NULL)
+        return NULL;
+
+    do
     {
+        seq = aesd_circular_buffer_read_begin(buffer);
+        found = aesd_circular_buffer_search(buffer, char_offset, &copy, &entry_offset_byte);
+    } while (aesd_circular_buffer_read_retry(buffer, seq));
 
-#ifdef __KERNEL__
-        mutex_lock(&buffer->lock);
-#else
-        pthread_mutex_lock(&buffer->lock);
-#endif
+    if (found)
+        *entry_offset_byte_rtn = entry_offset_byte;
+    return found;
+}
 
-        size_t cumulative_size = 0;
-        uint8_t index = buffer->out_offs;
-        uint8_t count = 0;
-        uint8_t max_entries = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+/**
+ * Like aesd_circular_buffer_find_entry_offset_for_fpos, but copies the entry to @param entry_rtn
+ * instead of returning a pointer into @param buffer, so the copy stays consistent even if the
+ * producer reuses the slot afterwards.  The memory referenced by buffptr is still managed by the caller.
+ * @return true if @param char_offset is within the buffer; @param entry_rtn and
+ *      @param entry_offset_byte_rtn are only set in that case
+ */
+bool aesd_circular_buffer_snapshot_entry(struct aesd_circular_buffer *buffer, size_t char_offset,
+                                         struct aesd_buffer_entry *entry_rtn, size_t *entry_offset_byte_rtn)
+{
+    struct aesd_buffer_entry *found;
+    struct aesd_buffer_entry copy;
+    size_t entry_offset_byte = 0;
+    unsigned int seq;
 
-        if (!buffer->full)
-        {
-            max_entries = buffer->in_offs;
-        }
+    if (buffer == NULL || entry_rtn == NULL || entry_offset_byte_rtn == NULL)
+        return false;
+
+    do
+    {
+        seq = aesd_circular_buffer_read_begin(buffer);
+        found = aesd_circular_buffer_search(buffer, char_offset, &copy, &entry_offset_byte);
+    } while (aesd_circular_buffer_read_retry(buffer, seq));
+
+    if (!found)
+        return false;
+    entry_rtn->buffptr = copy.buffptr;
+    entry_rtn->size = copy.size;
+    entry_rtn->end_offs = copy.end_offs;
+    *entry_offset_byte_rtn = entry_offset_byte;
+    return true;
+}
 
-        while (count < max_entries)
+/**
+ * @param buffer the buffer to search.  Any necessary locking must be performed by caller.
+ * @param entry_index the zero referenced index of the entry, 0 being the oldest entry in the buffer
+ * @param entry_offset_byte the zero referenced byte within that entry
+ * @param char_offset_rtn is a pointer specifying a location to store the char offset (as used by
+ *      aesd_circular_buffer_find_entry_offset_for_fpos) of the requested byte.  Only set on success.
+ * @return the entry at @param entry_index, or NULL if the entry does not exist or
+ *      @param entry_offset_byte is not within it.
+ */
+struct aesd_buffer_entry *aesd_circular_buffer_find_fpos_for_entry(struct aesd_circular_buffer *buffer,
+                                                                   size_t entry_index, size_t entry_offset_byte,
+                                                                   size_t *char_offset_rtn)
+{
+    struct aesd_circular_buffer_head head;
+    struct aesd_buffer_entry *entry;
+    struct aesd_buffer_entry copy;
+    size_t char_offset = 0;
+    unsigned int seq;
+
+    if (buffer == NULL || char_offset_rtn == NULL)
+        return NULL;
+
+    do
+    {
+        seq = aesd_circular_buffer_read_begin(buffer);
+        do
         {
-            struct aesd_buffer_entry *current_entry = &buffer->entry[index];
-            if (char_offset < (cumulative_size + current_entry->size))
-            {
-                *entry_offset_byte_rtn = char_offset - cumulative_size;
+            entry = NULL;
+            aesd_circular_buffer_read_head(buffer, &head);
+            if (entry_index >= head.count)
+                break;
+            entry = &buffer->entry[(head.out_offs + entry_index) % buffer->capacity];
+            aesd_circular_buffer_slot_load(entry, &copy);
+            // Una entrada posterior a la cabecera leída tiene un end_offs mayor que head_offs
+        } while (aesd_circular_buffer_slot_reused(copy.end_offs <= head.base_offs || copy.end_offs > head.head_offs));
 
-#ifdef __KERNEL__
-                mutex_unlock(&buffer->lock);
-#else
-                pthread_mutex_unlock(&buffer->lock);
-#endif
+        if (entry && entry_offset_byte < copy.size)
+            char_offset = copy.end_offs - copy.size - head.base_offs + entry_offset_byte;
+        else
+            entry = NULL;
+    } while (aesd_circular_buffer_read_retry(buffer, seq));
 
-                return current_entry;
-            }
-            cumulative_size += current_entry->size;
-            index = (index + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
-            count++;
-        }
+    if (entry)
+        *char_offset_rtn = char_offset;
+    return entry;
+}
+
+/**
+ * @return the number of entries currently stored in @param buffer
+ */
+size_t aesd_circular_buffer_count(struct aesd_circular_buffer *buffer)
+{
+    struct aesd_circular_buffer_head head;
+    unsigned int seq;
+
+    if (buffer == NULL)
+        return 0;
+
+    do
+    {
+        seq = aesd_circular_buffer_read_begin(buffer);
+        aesd_circular_buffer_read_head(buffer, &head);
+    } while (aesd_circular_buffer_read_retry(buffer, seq));
+
+    return head.count;
+}
+
+/**
+ * @return the total number of bytes stored across all entries of @param buffer
+ */
+size_t aesd_circular_buffer_size(struct aesd_circular_buffer *buffer)
+{
+    struct aesd_circular_buffer_head head;
+    unsigned int seq;
+
+    if (buffer == NULL)
+        return 0;
+
+    do
+    {
+        seq = aesd_circular_buffer_read_begin(buffer);
+        aesd_circular_buffer_read_head(buffer, &head);
+    } while (aesd_circular_buffer_read_retry(buffer, seq));
+
+    return head.head_offs - head.base_offs;
+}
+
+/**
+ * @param buffer the buffer containing @param entry.  Any necessary locking must be performed by caller.
+ * @param entry an entry previously returned by aesd_circular_buffer_find_entry_offset_for_fpos or by this function
+ * @return the entry written immediately after @param entry, or NULL if @param entry is the most recent one.
+ */
+struct aesd_buffer_entry *aesd_circular_buffer_next_entry(struct aesd_circular_buffer *buffer,
+                                                          const struct aesd_buffer_entry *entry)
+{
+    size_t index;
+
+    if (buffer == NULL || entry == NULL)
+        return NULL;
+
+    index = (size_t)(entry - buffer->entry);
+    index = (index + 1) % buffer->capacity;
+
+    // in_offs es la siguiente posición libre: hemos llegado al final del historial
+    if (index == buffer->in_offs)
+        return NULL;
+
+    return &buffer->entry[index];
+}
+
+// Añade la entrada sin tomar el lock; devuelve el buffptr desplazado si el buffer estaba lleno
+static const char *aesd_circular_buffer_push(struct aesd_circular_buffer *buffer,
+                                             const struct aesd_buffer_entry *add_entry)
+{
+    const char *displaced = NULL;
+    size_t head_offs = buffer->head_offs + add_entry->size;
+
+    if (buffer->full == true)
+    {
+        // La entrada más antigua se descarta: sus bytes dejan de contar
+        displaced = buffer->entry[buffer->out_offs].buffptr;
+        buffer->base_offs = buffer->entry[buffer->out_offs].end_offs;
+        // Avanzamos out_offs para descartar la entrada más antigua
+        buffer->out_offs = (buffer->out_offs + 1) % buffer->capacity;
+        buffer->full = false;
+        aesd_circular_buffer_evicted(buffer);
     }
+    // Copiamos la nueva entrada en la posición in_offs
+    aesd_circular_buffer_slot_store(&buffer->entry[buffer->in_offs], add_entry->buffptr, add_entry->size, head_offs);
+    buffer->head_offs = head_offs;
 
-#ifdef __KERNEL__
-    mutex_unlock(&buffer->lock);
-#else
-    pthread_mutex_unlock(&buffer->lock);
-#endif
+    // Avanzamos in_offs
+    buffer->in_offs = (buffer->in_offs + 1) % buffer->capacity;
+
+    buffer->full = buffer->in_offs == buffer->out_offs;
 
-    return NULL;
+    return displaced;
+}
+
+// Quita la entrada más antigua sin tomar el lock; false si el buffer está vacío
+static bool aesd_circular_buffer_pop(struct aesd_circular_buffer *buffer, struct aesd_buffer_entry *removed_rtn)
+{
+    struct aesd_buffer_entry *oldest;
+
+    if (aesd_circular_buffer_entry_count(buffer) == 0)
+        return false;
+
+    oldest = &buffer->entry[buffer->out_offs];
+    if (removed_rtn)
+        aesd_circular_buffer_slot_load(oldest, removed_rtn);
+    buffer->base_offs = oldest->end_offs;
+    buffer->out_offs = (buffer->out_offs + 1) % buffer->capacity;
+    buffer->full = false;
+    aesd_circular_buffer_evicted(buffer);
+    // end_offs también se borra: un lector sin lock no confunde el hueco con la entrada
+    aesd_circular_buffer_slot_store(oldest, NULL, 0, 0);
+    return true;
 }
 
 /**
@@ -89,40 +493,244 @@ struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct
  * new start location.
  * Any necessary locking must be handled by the caller
  * Any memory referenced in @param add_entry must be allocated by and/or must have a lifetime managed by the caller.
+ * @return the buffptr of the entry that was overwritten, so the caller can release it, or NULL
+ *      if the buffer was not full.
  */
-void aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entry)
+const char *aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entry)
 {
-    /**
-     * TODO: implement per description
-     */
+    const char *displaced = NULL;
+
     if (buffer != NULL && add_entry != NULL)
     {
+        aesd_circular_buffer_lock(buffer);
+        displaced = aesd_circular_buffer_push(buffer, add_entry);
+        aesd_circular_buffer_unlock(buffer);
+    }
+    return displaced;
+}
 
-#ifdef __KERNEL__
-        mutex_lock(&buffer->lock);
-#else
-        pthread_mutex_lock(&buffer->lock);
-#endif
+/**
+ * Removes the oldest entry from @param buffer, copying it to @param removed_rtn so the caller
+ * can release any memory it references.
+ * Any necessary locking must be handled by the caller
+ * @return true if an entry was removed, false if the buffer was empty
+ */
+bool aesd_circular_buffer_remove_oldest(struct aesd_circular_buffer *buffer, struct aesd_buffer_entry *removed_rtn)
+{
+    bool removed;
+
+    if (buffer == NULL)
+        return false;
+
+    aesd_circular_buffer_lock(buffer);
+    removed = aesd_circular_buffer_pop(buffer, removed_rtn);
+    aesd_circular_buffer_unlock(buffer);
+
+    return removed;
+}
+
+/**
+ * Makes @param buffer keep the data of the entries added with aesd_circular_buffer_add_entry_arena
+ * in @param arena, a caller allocated ring of @param arena_size bytes, instead of in memory
+ * allocated per entry.  The buffer must be empty.  The arena must outlive its use by the buffer.
+ * Any necessary locking must be handled by the caller
+ * @return false if the buffer is not empty or the arguments are not valid
+ */
+bool aesd_circular_buffer_set_arena(struct aesd_circular_buffer *buffer, char *arena, size_t arena_size)
+{
+    bool ok = false;
+
+    if (buffer == NULL || arena == NULL || arena_size == 0)
+        return false;
+
+    aesd_circular_buffer_lock(buffer);
+    if (aesd_circular_buffer_entry_count(buffer) == 0)
+    {
+        buffer->arena = arena;
+        buffer->arena_size = arena_size;
+        buffer->arena_wrap_offs = buffer->head_offs;
+        ok = true;
+    }
+    aesd_circular_buffer_unlock(buffer);
 
-        if (buffer->full == true)
+    return ok;
+}
+
+/**
+ * Copies @param size bytes from @param data into the arena of @param buffer and adds them as
+ * the newest entry.  The oldest entries are evicted until the data fits: entries are stored
+ * back to back and one that does not fit before the end of the arena starts again at its
+ * beginning, so each entry is a single span and any range of the history at most two.
+ * The buffptr of the entry points into the arena; it stays valid until the entry is evicted.
+ * Any necessary locking must be handled by the caller
+ * @param evicted_rtn if not NULL, set to the number of entries evicted to make room
+ * @return false if @param buffer has no arena or @param size is 0 or larger than the arena
+ */
+bool aesd_circular_buffer_add_entry_arena(struct aesd_circular_buffer *buffer, const char *data, size_t size,
+                                          size_t *evicted_rtn)
+{
+    struct aesd_buffer_entry new_entry;
+    size_t evicted = 0;
+    size_t place;
+
+    if (buffer == NULL || buffer->arena == NULL || data == NULL || size == 0 || size > buffer->arena_size)
+        return false;
+
+    aesd_circular_buffer_lock(buffer);
+
+    // Sin huecos en entry: la más antigua sale antes de buscar sitio en el arena
+    if (buffer->full && aesd_circular_buffer_pop(buffer, NULL))
+        evicted++;
+
+    for (;;)
+    {
+        size_t count = aesd_circular_buffer_entry_count(buffer);
+        const struct aesd_buffer_entry *newest;
+        size_t oldest_start;
+        size_t in;
+
+        if (count == 0)
         {
-            // Avanzamos out_offs para descartar la entrada más antigua
-            buffer->out_offs = (buffer->out_offs + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+            // Vacío: se vuelve a empezar desde el principio del arena
+            place = 0;
+            buffer->arena_wrap_offs = buffer->head_offs;
+            break;
         }
-        // Copiamos la nueva entrada en la posición in_offs
-        buffer->entry[buffer->in_offs] = *add_entry;
 
-        // Avanzamos in_offs
-        buffer->in_offs = (buffer->in_offs + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+        oldest_start = (size_t)(aesd_circular_buffer_entry_at(buffer, 0)->buffptr - buffer->arena);
+        newest = aesd_circular_buffer_entry_at(buffer, count - 1);
+        in = (size_t)(newest->buffptr - buffer->arena) + newest->size;
 
-        buffer->full = (buffer->in_offs == buffer->out_offs);
+        if (buffer->arena_wrap_offs > buffer->base_offs)
+        {
+            // Datos partidos: el hueco libre está entre la más nueva y la más antigua
+            if (size <= oldest_start - in)
+            {
+                place = in;
+                break;
+            }
+        }
+        else
+        {
+            if (size <= buffer->arena_size - in)
+            {
+                place = in;
+                break;
+            }
+            // No cabe al final: se salta ese resto y se empieza desde el principio
+            if (size <= oldest_start)
+            {
+                place = 0;
+                buffer->arena_wrap_offs = buffer->head_offs;
+                break;
+            }
+        }
 
-#ifdef __KERNEL__
-        mutex_unlock(&buffer->lock);
-#else
-        pthread_mutex_unlock(&buffer->lock);
-#endif
+        aesd_circular_buffer_pop(buffer, NULL);
+        evicted++;
     }
+
+    memcpy(buffer->arena + place, data, size);
+    new_entry.buffptr = buffer->arena + place;
+    new_entry.size = size;
+    new_entry.end_offs = 0;
+    aesd_circular_buffer_push(buffer, &new_entry);
+
+    aesd_circular_buffer_unlock(buffer);
+
+    if (evicted_rtn)
+        *evicted_rtn = evicted;
+    return true;
+}
+
+/**
+ * Describes where the @param len bytes of history starting at @param char_offset are stored in
+ * the arena of @param buffer, without copying them.  @param len is clamped to the end of the history.
+ * Any necessary locking must be performed by caller.
+ * @param span_ptr_rtn,span_len_rtn set to the start and length of each span, in order
+ * @return the number of spans (0 if @param char_offset is past the end of the history or
+ *      @param buffer has no arena, otherwise 1 or 2)
+ */
+size_t aesd_circular_buffer_arena_spans(struct aesd_circular_buffer *buffer, size_t char_offset, size_t len,
+                                        const char *span_ptr_rtn[2], size_t span_len_rtn[2])
+{
+    struct aesd_buffer_entry *entry;
+    size_t entry_offset_byte;
+    size_t pos;
+
+    if (buffer == NULL || buffer->arena == NULL || span_ptr_rtn == NULL || span_len_rtn == NULL)
+        return 0;
+
+    entry = aesd_circular_buffer_find_entry_offset_for_fpos(buffer, char_offset, &entry_offset_byte);
+    if (entry == NULL || len == 0)
+        return 0;
+
+    if (len > buffer->head_offs - buffer->base_offs - char_offset)
+        len = buffer->head_offs - buffer->base_offs - char_offset;
+
+    span_ptr_rtn[0] = entry->buffptr + entry_offset_byte;
+    span_len_rtn[0] = len;
+
+    // Posición absoluta (como end_offs) de char_offset
+    pos = buffer->base_offs + char_offset;
+    if (buffer->arena_wrap_offs > buffer->base_offs && pos < buffer->arena_wrap_offs &&
+        pos + len > buffer->arena_wrap_offs)
+    {
+        // El rango cruza el salto al principio del arena
+        span_len_rtn[0] = buffer->arena_wrap_offs - pos;
+        span_ptr_rtn[1] = buffer->arena;
+        span_len_rtn[1] = len - span_len_rtn[0];
+        return 2;
+    }
+    return 1;
+}
+
+/**
+ * Moves the contents of @param buffer into the caller allocated array @param entries of
+ * @param capacity elements, keeping the entries in order, and uses it as storage from now on.
+ * The buffer must not hold more than @param capacity entries: use
+ * aesd_circular_buffer_remove_oldest first when shrinking.
+ * Any necessary locking must be handled by the caller
+ * @param old_entries_rtn is set to the storage previously used by the buffer, for the caller to
+ *      release, or to NULL if it was the storage embedded in the buffer.  Only set on success.
+ * @return true if @param buffer now uses @param entries, false if the arguments were not valid
+ *      (the buffer is left unchanged).
+ */
+bool aesd_circular_buffer_resize(struct aesd_circular_buffer *buffer, struct aesd_buffer_entry *entries,
+                                 size_t capacity, struct aesd_buffer_entry **old_entries_rtn)
+{
+    size_t count;
+    size_t i;
+
+    if (buffer == NULL || entries == NULL || old_entries_rtn == NULL || capacity == 0 ||
+        capacity > AESDCHAR_MAX_CAPACITY)
+        return false;
+
+    aesd_circular_buffer_lock(buffer);
+
+    count = aesd_circular_buffer_entry_count(buffer);
+    if (count > capacity)
+    {
+        aesd_circular_buffer_unlock(buffer);
+        return false;
+    }
+
+    // Las entradas quedan al principio del nuevo array, de la más antigua a la más reciente
+    for (i = 0; i < count; i++)
+        entries[i] = *aesd_circular_buffer_entry_at(buffer, i);
+    // Sin lectores durante el cambio: el resto de posiciones se deja a cero
+    memset(entries + count, 0, (capacity - count) * sizeof(*entries));
+
+    *old_entries_rtn = (buffer->entry == buffer->default_entry) ? NULL : buffer->entry;
+    buffer->entry = entries;
+    buffer->capacity = capacity;
+    buffer->out_offs = 0;
+    buffer->in_offs = count % capacity;
+    buffer->full = (count == capacity);
+
+    aesd_circular_buffer_unlock(buffer);
+
+    return true;
 }
 
 /**
@@ -131,10 +739,10 @@ void aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const s
 void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer)
 {
     memset(buffer, 0, sizeof(struct aesd_circular_buffer));
+    buffer->entry = buffer->default_entry;
+    buffer->capacity = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
 
-#ifdef __KERNEL__
-    mutex_init(&buffer->lock);
-#else
+#if !defined(__KERNEL__) && !defined(AESD_CIRCULAR_BUFFER_LOCKFREE)
     pthread_mutexattr_t attr;
     pthread_mutexattr_init(&attr);
     /* Opcional: mutex robusto para recuperación si un hilo muere con el lock */
@@ -10,16 +10,39 @@
 
 #ifdef __KERNEL__
 #include <linux/types.h>
-#include <linux/spinlock.h>
 #else
 #include <stddef.h> // size_t
 #include <stdint.h> // uintx_t
 #include <stdbool.h>
+#ifndef AESD_CIRCULAR_BUFFER_LOCKFREE
 #include <pthread.h>
 #endif
+#endif
+
+/*
+ * User space builds with AESD_CIRCULAR_BUFFER_LOCKFREE defined replace the mutex with sequence
+ * counters: a single producer (add_entry, add_entry_arena, remove_oldest, resize, set_arena; callers
+ * must serialize producers among themselves) never waits for readers, and readers
+ * (find_entry_offset_for_fpos, find_fpos_for_entry, snapshot_entry, count, size) never block the
+ * producer.  One counter covers the indices and running totals and each slot of the entry array has
+ * its own, so a reader only retries if the buffer changed while it copied those few fields or the one
+ * slot it found, not whenever an entry is added during its search.  Fields shared with readers are
+ * only accessed atomically.  Returned entries point into the buffer and may be reused once the
+ * producer overwrites them; copy what is needed with aesd_circular_buffer_snapshot_entry.
+ * Resizing requires that no reader is running.
+ */
 
+/**
+ * Capacity of a buffer set up with aesd_circular_buffer_init, which uses the
+ * storage embedded in struct aesd_circular_buffer
+ */
 #define AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED 10
 
+/**
+ * Largest capacity accepted by aesd_circular_buffer_resize
+ */
+#define AESDCHAR_MAX_CAPACITY (1u << 20)
+
 struct aesd_buffer_entry
 {
     /**
@@ -30,32 +53,143 @@ struct aesd_buffer_entry
      * Number of bytes stored in buffptr
      */
     size_t size;
+    /**
+     * Running total of bytes added to the buffer up to and including this entry.
+     * Set by aesd_circular_buffer_add_entry, any value passed in is ignored.
+     */
+    size_t end_offs;
+#if !defined(__KERNEL__) && defined(AESD_CIRCULAR_BUFFER_LOCKFREE)
+    /**
+     * Odd while the producer is rewriting this slot of the entry array.  Ignored in entries
+     * passed in by callers.
+     */
+    unsigned int seq;
+#endif
+};
+
+#if !defined(__KERNEL__) && defined(AESD_CIRCULAR_BUFFER_LOCKFREE)
+/**
+ * Number of copies of the indices and running totals kept for lock-free readers
+ */
+#define AESD_CIRCULAR_BUFFER_HEADS 4
+#endif
+
+/**
+ * The indices and running totals a reader needs, read together
+ */
+struct aesd_circular_buffer_head
+{
+    size_t out_offs;
+    size_t count;
+    size_t head_offs;
+    size_t base_offs;
+#if !defined(__KERNEL__) && defined(AESD_CIRCULAR_BUFFER_LOCKFREE)
+    /**
+     * Odd while the producer is rewriting this copy
+     */
+    unsigned int seq;
+#endif
 };
 
 struct aesd_circular_buffer
 {
     /**
-     * An array of pointers to memory allocated for the most recent write operations
+     * An array of pointers to memory allocated for the most recent write operations.
+     * Points to default_entry unless aesd_circular_buffer_resize installed other storage.
      */
-    struct aesd_buffer_entry entry[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    struct aesd_buffer_entry *entry;
+    /**
+     * Number of elements in entry
+     */
+    size_t capacity;
     /**
      * The current location in the entry structure where the next write should
      * be stored.
      */
-    uint8_t in_offs;  /** The first location in the entry structure to read from */
-    uint8_t out_offs; /** set to true when the buffer entry structure is full */
+    size_t in_offs;  /** The first location in the entry structure to read from */
+    size_t out_offs; /** set to true when the buffer entry structure is full */
     bool full;
-#ifdef __KERNEL__
-    struct mutex lock;
+    /**
+     * Running total of bytes ever added, equal to end_offs of the newest entry
+     */
+    size_t head_offs;
+    /**
+     * Running total at the start of the oldest entry (bytes already overwritten).
+     * The char offset of an entry is its end_offs - size - base_offs.
+     */
+    size_t base_offs;
+    /**
+     * Storage used by aesd_circular_buffer_init
+     */
+    struct aesd_buffer_entry default_entry[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    /**
+     * Byte ring installed by aesd_circular_buffer_set_arena, or NULL if every entry points to
+     * its own separately allocated memory.  Entries added with aesd_circular_buffer_add_entry_arena
+     * point into the arena and are never split across its end.
+     */
+    char *arena;
+    /**
+     * Size of arena in bytes
+     */
+    size_t arena_size;
+    /**
+     * Running total at the start of the entry most recently placed at the beginning of the arena.
+     * While it is greater than base_offs the live data wraps: it runs from the oldest entry to
+     * the end of the used part of the arena, then from the start of the arena.
+     */
+    size_t arena_wrap_offs;
+#ifndef __KERNEL__
+#ifdef AESD_CIRCULAR_BUFFER_LOCKFREE
+    /**
+     * Copies of the indices and running totals, published by the producer after each change.
+     * Readers copy heads[head_idx] while the producer writes the next one, so a reader only
+     * retries if the producer publishes AESD_CIRCULAR_BUFFER_HEADS times while it copies.
+     */
+    struct aesd_circular_buffer_head heads[AESD_CIRCULAR_BUFFER_HEADS];
+    /**
+     * Index in heads of the newest published copy
+     */
+    unsigned int head_idx;
 #else
+    /**
+     * Taken by the functions below in user space builds.  Kernel callers provide their own locking.
+     */
     pthread_mutex_t lock;
 #endif
+#endif
 };
 
 extern struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct aesd_circular_buffer *buffer,
                                                                                  size_t char_offset, size_t *entry_offset_byte_rtn);
 
-extern void aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entry);
+extern struct aesd_buffer_entry *aesd_circular_buffer_find_fpos_for_entry(struct aesd_circular_buffer *buffer,
+                                                                          size_t entry_index, size_t entry_offset_byte,
+                                                                          size_t *char_offset_rtn);
+
+extern bool aesd_circular_buffer_snapshot_entry(struct aesd_circular_buffer *buffer, size_t char_offset,
+                                                struct aesd_buffer_entry *entry_rtn, size_t *entry_offset_byte_rtn);
+
+extern size_t aesd_circular_buffer_count(struct aesd_circular_buffer *buffer);
+
+extern size_t aesd_circular_buffer_size(struct aesd_circular_buffer *buffer);
+
+extern struct aesd_buffer_entry *aesd_circular_buffer_next_entry(struct aesd_circular_buffer *buffer,
+                                                                 const struct aesd_buffer_entry *entry);
+
+extern const char *aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entry);
+
+extern bool aesd_circular_buffer_remove_oldest(struct aesd_circular_buffer *buffer, struct aesd_buffer_entry *removed_rtn);
+
+extern bool aesd_circular_buffer_set_arena(struct aesd_circular_buffer *buffer, char *arena, size_t arena_size);
+
+extern bool aesd_circular_buffer_add_entry_arena(struct aesd_circular_buffer *buffer, const char *data, size_t size,
+                                                 size_t *evicted_rtn);
+
+extern size_t aesd_circular_buffer_arena_spans(struct aesd_circular_buffer *buffer, size_t char_offset, size_t len,
+                                               const char *span_ptr_rtn[2], size_t span_len_rtn[2]);
+
+extern bool aesd_circular_buffer_resize(struct aesd_circular_buffer *buffer, struct aesd_buffer_entry *entries,
+                                        size_t capacity, struct aesd_buffer_entry **old_entries_rtn);
 
 extern void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer);
 
@@ -64,9 +198,9 @@ extern void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer);
  * Useful when you've allocated memory for circular buffer entries and need to free it
  * @param entryptr is a struct aesd_buffer_entry* to set with the current entry
  * @param buffer is the struct aesd_buffer * describing the buffer
- * @param index is a uint8_t stack allocated value used by this macro for an index
+ * @param index is a size_t stack allocated value used by this macro for an index
  * Example usage:
- * uint8_t index;
+ * size_t index;
  * struct aesd_circular_buffer buffer;
  * struct aesd_buffer_entry *entry;
  * AESD_CIRCULAR_BUFFER_FOREACH(entry,&buffer,index) {
@@ -75,7 +209,7 @@ extern void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer);
  */
 #define AESD_CIRCULAR_BUFFER_FOREACH(entryptr, buffer, index) \
     for (index = 0, entryptr = &((buffer)->entry[index]);     \
-         index < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;     \
+         index < (buffer)->capacity;                          \
          index++, entryptr = &((buffer)->entry[index]))
 
 #endif /* AESD_CIRCULAR_BUFFER_H */
@@ -34,15 +34,127 @@ struct aesd_seekto
     uint32_t write_cmd_offset;
 };
 
+/**
+ * One record requested with AESDCHAR_IOCSEEKREAD
+ */
+struct aesd_seekread_range
+{
+    /**
+     * The zero referenced write command to read from
+     */
+    uint32_t write_cmd;
+    /**
+     * The zero referenced offset within the write
+     */
+    uint32_t write_cmd_offset;
+    /**
+     * Maximum number of bytes to read, the read never goes past the end of the write
+     */
+    uint32_t length;
+    /**
+     * Set by the driver to the number of bytes copied for this range, 0 if the write does not exist
+     */
+    uint32_t bytes_read;
+};
+
+/**
+ * Argument of AESDCHAR_IOCSEEKREAD: the data of each range is copied to buf one after
+ * the other, in the order of the ranges array, until buf_len bytes have been written
+ */
+struct aesd_seekread
+{
+    /**
+     * User pointer to an array of range_count struct aesd_seekread_range, updated in place
+     */
+    uint64_t ranges;
+    /**
+     * Number of ranges, at most AESD_SEEKREAD_MAX_RANGES
+     */
+    uint32_t range_count;
+    uint32_t reserved;
+    /**
+     * User pointer to the destination buffer
+     */
+    uint64_t buf;
+    /**
+     * Size of the destination buffer in bytes
+     */
+    uint64_t buf_len;
+};
+
+#define AESD_SEEKREAD_MAX_RANGES 1024
+
 // Pick an arbitrary unused value from https://github.com/torvalds/linux/blob/master/Documentation/userspace-api/ioctl/ioctl-number.rst
 #define AESD_IOC_MAGIC 0x16
 
 // Define a write command from the user point of view, use command number 1
 #define AESDCHAR_IOCSEEKTO _IOWR(AESD_IOC_MAGIC, 1, struct aesd_seekto)
 
+// Set the number of write commands kept in the history, oldest commands are dropped if it shrinks
+#define AESDCHAR_IOCSETMAXENTRIES _IOW(AESD_IOC_MAGIC, 2, uint32_t)
+
+// Set the maximum bytes retained in the history (0 for no limit), oldest commands are dropped to fit.
+// It counts command bytes, not the driver's allocations; a partial command is limited to it separately.
+#define AESDCHAR_IOCSETMAXBYTES _IOW(AESD_IOC_MAGIC, 3, uint64_t)
+
+// Non-zero puts this open file in follow mode: at the end of the history read() blocks until the
+// next command is written (or fails with EAGAIN for O_NONBLOCK), like tail -f
+#define AESDCHAR_IOCSETFOLLOW _IOW(AESD_IOC_MAGIC, 4, uint32_t)
+
+// Read several (write_cmd, offset, length) ranges with a single call, all from the same version of the
+// history.  Returns the total number of bytes copied to buf, per range counts are stored in bytes_read
+#define AESDCHAR_IOCSEEKREAD _IOWR(AESD_IOC_MAGIC, 5, struct aesd_seekread)
+
+/**
+ * Header placed at the start of the read-only mapping returned by mmap() on the
+ * aesdchar device.  The history (all commands concatenated, oldest first) starts
+ * header_size bytes after the start of the mapping.
+ *
+ * generation works like a sequence lock: it is odd while the driver is updating
+ * the mapping and is incremented again when the update completes.  A reader
+ * should load generation, copy what it needs, then load generation again and
+ * retry if it was odd or has changed.
+ */
+struct aesd_mmap_header
+{
+    /**
+     * Always AESD_MMAP_MAGIC
+     */
+    uint32_t magic;
+    /**
+     * Offset in bytes from the start of the mapping to the history data
+     */
+    uint32_t header_size;
+    /**
+     * Incremented before and after every update of the mapping
+     */
+    uint64_t generation;
+    /**
+     * Number of valid bytes of history in the data area
+     */
+    uint64_t data_size;
+    /**
+     * Size of the data area in bytes
+     */
+    uint64_t data_capacity;
+    /**
+     * Number of complete commands in the data area
+     */
+    uint32_t entry_count;
+    /**
+     * AESD_MMAP_* flags
+     */
+    uint32_t flags;
+};
+
+#define AESD_MMAP_MAGIC 0x41455344 /* "AESD" */
+
+// The history did not fit in the data area, only the newest commands that fit are mapped
+#define AESD_MMAP_TRUNCATED 0x1
+
 /**
  * The maximum number of commands supported, used for bounds checking
  */
-#define AESDCHAR_IOC_MAXNR 1
+#define AESDCHAR_IOC_MAXNR 5
 
 #endif /* AESD_IOCTL_H */
@@ -8,17 +8,18 @@
 #ifndef AESD_CHAR_DRIVER_AESDCHAR_H_
 #define AESD_CHAR_DRIVER_AESDCHAR_H_
 
-#define AESD_DEBUG 1 // Remove comment on this line to enable debug
+//#define AESD_DEBUG 1 // Remove comment on this line to enable debug
 
 #undef PDEBUG /* undef it, just in case */
-#ifdef AESD_DEBUG
 #ifdef __KERNEL__
-/* This one if debugging is on, and kernel space */
-#define PDEBUG(fmt, args...) printk(KERN_DEBUG "aesdchar: " fmt, ##args)
-#else
+/* Kernel space: dynamic debug, off by default and enabled at runtime with
+ *   echo 'module aesdchar +p' > /sys/kernel/debug/dynamic_debug/control
+ * (make DEBUG=y turns the messages on at build time instead)
+ */
+#define PDEBUG(fmt, args...) pr_debug("aesdchar: " fmt, ##args)
+#elif defined(AESD_DEBUG)
 /* This one for user space */
 #define PDEBUG(fmt, args...) fprintf(stderr, fmt, ##args)
-#endif
 #else
 #define PDEBUG(fmt, args...) /* not debugging: nothing */
 #endif
@@ -26,6 +27,37 @@
 #include "aesd-circular-buffer.h"
 #include <linux/cdev.h>
 #include <linux/mutex.h>
+#include <linux/seqlock.h>
+#include <linux/wait.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/atomic.h>
+#include <linux/percpu.h>
+#include <linux/debugfs.h>
+
+/* Histogramas de latencia: el bucket i cuenta las operaciones de menos de
+ * 2^(10+i) ns (el primero, menos de ~1 us); el último acumula el resto
+ */
+#define AESD_LAT_BUCKETS 16
+
+/* Contadores por CPU de cada dispositivo, se suman al leer debugfs */
+struct aesd_stats
+{
+     u64 reads;
+     u64 read_bytes;
+     u64 writes;
+     u64 write_bytes;
+     u64 commits; // comandos completos añadidos al historial
+     u64 evictions; // comandos expulsados (capacidad, presupuesto de bytes o resize)
+     long pending_bytes; // bytes de comandos a medias (la suma entre CPUs es la real)
+     u64 lock_contended; // veces que hubo que esperar dev->lock
+     u64 lock_wait_ns;
+     u64 read_lat[AESD_LAT_BUCKETS];
+     u64 write_lat[AESD_LAT_BUCKETS];
+};
+
+#define aesd_stat_inc(dev, field) this_cpu_inc((dev)->stats->field)
+#define aesd_stat_add(dev, field, n) this_cpu_add((dev)->stats->field, (n))
 
 struct aesd_dev
 {
@@ -33,11 +65,54 @@ struct aesd_dev
       * TODO: Add structure(s) and locks needed to complete assignment requirements
       */
      struct cdev cdev; /* Char device structure      */
-     struct mutex lock;
+     struct mutex lock; // serializa a los escritores
+     seqcount_mutex_t seq; // lo incrementan los escritores al tocar buffer; ver main.c
+     struct mutex resize_lock; // serializa los cambios del array de entradas, se toma antes que lock
+     bool resizing; // el array de entradas de buffer se está cambiando
      struct aesd_circular_buffer buffer;
-     // write parcial (comando en curso hasta '\n')
+     size_t max_bytes; // límite de bytes del historial, 0 = sin límite
+     // copia del historial compartida con mmap (vmalloc_user), NULL hasta el primer mmap
+     struct aesd_mmap_header *mmap_area;
+     size_t mmap_area_size;
+     unsigned int mmap_count; // mapeos activos, protegido por lock
+     // el área refleja el historial desde mmap_first_offs hasta mmap_head_offs (offsets acumulados)
+     bool mmap_synced;
+     size_t mmap_first_offs;
+     size_t mmap_head_offs;
+     wait_queue_head_t readq; // se despierta con cada comando completado
+     // modo aesd_percpu_staging: comandos completos aún no fusionados en buffer, NULL si no se usa
+     struct aesd_stage __percpu *stage;
+     atomic_t staged; // entradas en stage
+     atomic64_t stage_seq; // orden global de los comandos en stage
+     struct aesd_stats __percpu *stats;
+     struct dentry *debugfs_dir;
+};
+
+/* Comandos completados en una CPU y pendientes de fusionar en el historial */
+struct aesd_stage
+{
+     spinlock_t lock;
+     struct list_head list; // struct aesd_staged_entry, en orden de seq
+};
+
+struct aesd_staged_entry
+{
+     struct list_head node;
+     u64 seq;
+     struct aesd_buffer_entry entry;
+};
+
+/* Estado de cada fichero abierto (filp->private_data) */
+struct aesd_file
+{
+     struct aesd_dev *dev;
+     bool follow; // read espera nuevos comandos al final del historial (AESDCHAR_IOCSETFOLLOW)
+     size_t follow_base; // base_offs del buffer en la última lectura en modo follow
+     struct mutex lock; // serializa los write sobre este fichero
+     // write parcial (comando en curso hasta '\n') de este fichero
      char *pending_buf;
      size_t pending_size;
+     size_t pending_alloc; // capacidad reservada de pending_buf
 };
 
 #endif /* AESD_CHAR_DRIVER_AESDCHAR_H_ */
@@ -21,288 +21,1366 @@
 #include <linux/uaccess.h>
 #include <linux/string.h>
 #include <linux/device.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/version.h>
+#include <linux/uio.h>
+#include <linux/splice.h>
+#include <linux/seqlock.h>
+#include <linux/srcu.h>
+#include <linux/poll.h>
+#include <linux/wait.h>
+#include <linux/percpu.h>
+#include <linux/list_sort.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/ktime.h>
 
 #include "aesdchar.h"
 #include "aesd_ioctl.h"
 int aesd_major = 0; // use dynamic major
 int aesd_minor = 0;
 
+// Tamaño del área de datos expuesta por mmap (sin contar la cabecera)
+unsigned int aesd_mmap_data_size = 1024 * 1024;
+module_param(aesd_mmap_data_size, uint, 0444);
+MODULE_PARM_DESC(aesd_mmap_data_size, "Bytes of history exposed through mmap");
+
+// Número de comandos que guarda el historial (se puede cambiar con AESDCHAR_IOCSETMAXENTRIES)
+unsigned int aesd_max_entries = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+module_param(aesd_max_entries, uint, 0444);
+MODULE_PARM_DESC(aesd_max_entries, "Number of write commands kept in the history");
+
+// Límite de bytes del historial, 0 = sin límite (se puede cambiar con AESDCHAR_IOCSETMAXBYTES)
+unsigned long aesd_max_bytes = 0;
+module_param(aesd_max_bytes, ulong, 0444);
+MODULE_PARM_DESC(aesd_max_bytes, "Maximum bytes of commands retained in the history, 0 for no limit");
+
+// Número de dispositivos (minors), cada uno con su propio historial
+unsigned int aesd_nr_devs = 1;
+module_param(aesd_nr_devs, uint, 0444);
+MODULE_PARM_DESC(aesd_nr_devs, "Number of aesdchar devices (minors), each with its own history");
+
+// Los comandos escritos de una vez se encolan por CPU sin tomar el mutex del dispositivo
+bool aesd_percpu_staging = false;
+module_param(aesd_percpu_staging, bool, 0444);
+MODULE_PARM_DESC(aesd_percpu_staging, "Stage single-write commands per CPU and merge them into the history on read");
+
+// Tamaño del arena de cada dispositivo, 0 = cada comando en su propia reserva de memoria
+unsigned long aesd_arena_size = 0;
+module_param(aesd_arena_size, ulong, 0444);
+MODULE_PARM_DESC(aesd_arena_size, "Store the history in a contiguous ring of this many bytes per device, 0 to allocate each command separately");
+
+#define AESD_MAX_DEVS 256
+
 MODULE_AUTHOR("Antonio Almenara López");
 MODULE_LICENSE("Dual BSD/GPL");
 
-struct aesd_dev aesd_device;
+struct aesd_dev *aesd_devices; // aesd_nr_devs dispositivos, el minor i es aesd_devices[i]
+static struct dentry *aesd_debugfs_root; // /sys/kernel/debug/aesdchar
+
+// Bucket del histograma de latencias para @param ns
+static inline unsigned int aesd_lat_bucket(u64 ns)
+{
+    unsigned int bucket = fls64(ns >> 10);
+
+    return min_t(unsigned int, bucket, AESD_LAT_BUCKETS - 1);
+}
+
+/*
+ * Lectores sin lock.
+ *
+ * Los escritores siguen serializados por dev->lock y envuelven cada cambio
+ * del buffer circular en dev->seq. Los lectores (read y AESDCHAR_IOCSEEKTO)
+ * no toman el mutex: copian los campos de la entrada que necesitan y validan
+ * la copia con read_seqcount_retry.
+ *
+ * El buffptr de una entrada expulsada se libera tras un periodo de gracia de
+ * aesd_srcu, así que un lector dentro de srcu_read_lock puede hacer
+ * copy_to_user (y dormir) sobre la instantánea aunque el escritor la expulse.
+ * Cada comando lleva en su reserva el rcu_head para ello (struct
+ * aesd_cmd_buf): expulsar nunca reserva memoria ni espera a los lectores.
+ * Cambiar el array de entradas (AESDCHAR_IOCSETMAXENTRIES) es el único caso
+ * en que los lectores esperan: ver aesd_reader_enter() y
+ * aesd_set_max_entries().
+ *
+ * Con aesd_arena_size los comandos viven en un único anillo de bytes y el
+ * escritor reutiliza en el acto el sitio de los expulsados, sin periodo de
+ * gracia posible: en ese modo los lectores toman dev->lock y copian a un
+ * buffer intermedio.
+ *
+ * Orden de locks: mmap_lock del proceso antes que dev->lock (aesd_mmap y las
+ * vm_ops se llaman con mmap_lock tomado). Por eso dev->lock nunca se mantiene
+ * durante copy_to_user, copy_from_user ni copy_to_iter, que pueden provocar un
+ * fallo de página y tomar mmap_lock. Como los lectores sin lock copian dentro
+ * de la sección SRCU, tampoco se espera un periodo de gracia de aesd_srcu con
+ * dev->lock tomado.
+ */
+DEFINE_STATIC_SRCU(aesd_srcu);
+
+/* Reserva de un comando (pending_buf, stage y entradas del historial): el
+ * buffptr apunta a data
+ */
+struct aesd_cmd_buf
+{
+    struct rcu_head rcu;
+    char data[];
+};
+
+static inline struct aesd_cmd_buf *aesd_cmd_buf_of(const char *buf)
+{
+    return (struct aesd_cmd_buf *)(buf - offsetof(struct aesd_cmd_buf, data));
+}
+
+// Reserva sitio para un comando de @param size bytes (GFP_NOWAIT: sólo kmalloc, no vmalloc)
+static char *aesd_cmd_alloc(size_t size, gfp_t gfp)
+{
+    struct aesd_cmd_buf *cmd;
+
+    if ((gfp & GFP_KERNEL) == GFP_KERNEL)
+        cmd = kvmalloc(sizeof(*cmd) + size, gfp);
+    else
+        cmd = kmalloc(sizeof(*cmd) + size, gfp);
+    return cmd ? cmd->data : NULL;
+}
+
+// Libera en el acto un comando que ningún lector puede ver
+static void aesd_cmd_free(const char *buf)
+{
+    if (buf)
+        kvfree(aesd_cmd_buf_of(buf));
+}
+
+static void aesd_cmd_free_cb(struct rcu_head *head)
+{
+    kvfree(container_of(head, struct aesd_cmd_buf, rcu));
+}
+
+/**
+ * Libera @param buf cuando ningún lector pueda estar usándolo.
+ * No reserva memoria ni duerme.
+ */
+static void aesd_free_entry_deferred(const char *buf)
+{
+    if (buf)
+        call_srcu(&aesd_srcu, &aesd_cmd_buf_of(buf)->rcu, aesd_cmd_free_cb);
+}
+
+/**
+ * Entra en la sección de lectura. Si se está cambiando el array de entradas,
+ * espera en dev->readq a que termine. En modo arena toma dev->lock hasta
+ * aesd_reader_exit.
+ * @return el índice SRCU para aesd_reader_exit, o un error negativo
+ */
+static int aesd_reader_enter(struct aesd_dev *dev, bool nowait)
+{
+    int idx;
+
+    if (dev->buffer.arena)
+    {
+        if (nowait)
+            return mutex_trylock(&dev->lock) ? 0 : -EAGAIN;
+        return mutex_lock_interruptible(&dev->lock) ? -ERESTARTSYS : 0;
+    }
+
+    for (;;)
+    {
+        idx = srcu_read_lock(&aesd_srcu);
+        if (!READ_ONCE(dev->resizing))
+            return idx;
+        srcu_read_unlock(&aesd_srcu, idx);
+
+        if (nowait)
+            return -EAGAIN;
+        if (wait_event_interruptible(dev->readq, !READ_ONCE(dev->resizing)))
+            return -ERESTARTSYS;
+    }
+}
+
+static void aesd_reader_exit(struct aesd_dev *dev, int idx)
+{
+    if (dev->buffer.arena)
+        mutex_unlock(&dev->lock);
+    else
+        srcu_read_unlock(&aesd_srcu, idx);
+}
+
+/**
+ * Copia sin lock la entrada que contiene @param pos.
+ * Debe llamarse entre aesd_reader_enter y aesd_reader_exit; *buffptr_rtn
+ * sigue siendo válido hasta aesd_reader_exit.
+ * @return false si no hay datos en @param pos
+ */
+static bool aesd_snapshot_entry(struct aesd_dev *dev, size_t pos, const char **buffptr_rtn,
+                                size_t *size_rtn, size_t *entry_offset_byte_rtn)
+{
+    const struct aesd_buffer_entry *entry;
+    unsigned int seq;
+
+    do
+    {
+        seq = read_seqcount_begin(&dev->seq);
+        entry = aesd_circular_buffer_find_entry_offset_for_fpos(&dev->buffer, pos, entry_offset_byte_rtn);
+        if (entry)
+        {
+            *buffptr_rtn = entry->buffptr;
+            *size_rtn = entry->size;
+        }
+    } while (read_seqcount_retry(&dev->seq, seq));
+
+    return entry != NULL;
+}
+
+/**
+ * Toma dev->lock contabilizando en las estadísticas el tiempo de espera si
+ * está ocupado.
+ * @return 0, -EAGAIN si @param nowait y está ocupado, o -ERESTARTSYS
+ */
+static int aesd_dev_lock(struct aesd_dev *dev, bool nowait)
+{
+    u64 start;
+
+    if (mutex_trylock(&dev->lock))
+        return 0;
+    if (nowait)
+        return -EAGAIN;
+
+    start = ktime_get_ns();
+    if (mutex_lock_interruptible(&dev->lock))
+        return -ERESTARTSYS;
+    aesd_stat_inc(dev, lock_contended);
+    aesd_stat_add(dev, lock_wait_ns, ktime_get_ns() - start);
+    return 0;
+}
+
+/**
+ * Añade @param new_entry al historial visible para los lectores.
+ * Debe llamarse con dev->lock tomado.
+ */
+static void aesd_add_entry_locked(struct aesd_dev *dev, const struct aesd_buffer_entry *new_entry)
+{
+    const char *displaced;
+
+    write_seqcount_begin(&dev->seq);
+    displaced = aesd_circular_buffer_add_entry(&dev->buffer, new_entry);
+    write_seqcount_end(&dev->seq);
+
+    // Despierta a los lectores en modo follow y a poll/epoll
+    wake_up_interruptible_all(&dev->readq);
+
+    aesd_stat_inc(dev, commits);
+    // Si el buffer estaba lleno, la entrada sobrescrita ya no es de nadie
+    if (displaced)
+        aesd_stat_inc(dev, evictions);
+    aesd_free_entry_deferred(displaced);
+}
+
+/**
+ * Copia @param size bytes de @param data al arena como comando más reciente.
+ * El llamante conserva @param data. Debe llamarse con dev->lock tomado.
+ */
+static void aesd_add_arena_locked(struct aesd_dev *dev, const char *data, size_t size)
+{
+    size_t evicted = 0;
+
+    write_seqcount_begin(&dev->seq);
+    aesd_circular_buffer_add_entry_arena(&dev->buffer, data, size, &evicted);
+    write_seqcount_end(&dev->seq);
+
+    wake_up_interruptible_all(&dev->readq);
+
+    aesd_stat_inc(dev, commits);
+    aesd_stat_add(dev, evictions, evicted);
+}
+
+/**
+ * Quita la entrada más antigua del historial.
+ * Debe llamarse con dev->lock tomado.
+ * @return false si el historial estaba vacío
+ */
+static bool aesd_remove_oldest_locked(struct aesd_dev *dev)
+{
+    struct aesd_buffer_entry removed;
+    bool ok;
+
+    write_seqcount_begin(&dev->seq);
+    ok = aesd_circular_buffer_remove_oldest(&dev->buffer, &removed);
+    write_seqcount_end(&dev->seq);
+
+    if (ok)
+    {
+        aesd_stat_inc(dev, evictions);
+        // En modo arena la memoria de la entrada es del anillo
+        if (!dev->buffer.arena)
+            aesd_free_entry_deferred(removed.buffptr);
+    }
+    return ok;
+}
+
+int aesd_open(struct inode *inode, struct file *filp)
+{
+    struct aesd_file *file;
+
+    PDEBUG("open");
+
+    file = kzalloc(sizeof(*file), GFP_KERNEL);
+    if (!file)
+        return -ENOMEM;
+    file->dev = container_of(inode->i_cdev, struct aesd_dev, cdev);
+    mutex_init(&file->lock);
+    filp->private_data = file;
+
+    return 0;
+}
+
+int aesd_release(struct inode *inode, struct file *filp)
+{
+    struct aesd_file *file = filp->private_data;
+
+    PDEBUG("release");
+
+    // Un comando sin '\n' al cerrar se descarta: nunca llegó a completarse
+    if (file->pending_size)
+    {
+        PDEBUG("discarding %zu bytes of incomplete command", file->pending_size);
+        aesd_stat_add(file->dev, pending_bytes, -(long)file->pending_size);
+    }
+    aesd_cmd_free(file->pending_buf);
+    mutex_destroy(&file->lock);
+    kfree(file);
+    filp->private_data = NULL;
+
+    return 0;
+}
+
+/**
+ * En modo follow traduce @param pos, relativa al historial de la última
+ * lectura, al historial actual: descuenta los bytes expulsados desde
+ * entonces para que el lector no salte ni repita comandos.
+ */
+static loff_t aesd_follow_pos(struct aesd_file *file, loff_t pos)
+{
+    size_t base = READ_ONCE(file->dev->buffer.base_offs);
+    size_t evicted = base - file->follow_base;
+
+    file->follow_base = base;
+    return (size_t)pos > evicted ? pos - (loff_t)evicted : 0;
+}
+
+/**
+ * No modifica el fichero: en modo follow @param pos es relativa al historial
+ * de file->follow_base, se haya traducido ya con aesd_follow_pos o no.
+ * @return true si hay datos a partir de @param pos
+ */
+static bool aesd_data_available(struct aesd_file *file, loff_t pos)
+{
+    struct aesd_dev *dev = file->dev;
+
+    // Comandos en stage: aún no están en el historial pero el siguiente read los verá
+    if (dev->stage && atomic_read(&dev->staged) > 0)
+        return true;
+    if (file->follow)
+        return READ_ONCE(dev->buffer.head_offs) - file->follow_base > (size_t)pos;
+    return READ_ONCE(dev->buffer.head_offs) - READ_ONCE(dev->buffer.base_offs) > (size_t)pos;
+}
+
+static int aesd_sync_staged(struct aesd_dev *dev, bool nowait);
+
+/**
+ * Copia a @param to hasta @param count bytes del historial a partir de
+ * @param pos, entrada a entrada y sin lock.
+ * Debe llamarse entre aesd_reader_enter y aesd_reader_exit.
+ */
+static ssize_t aesd_read_entries(struct aesd_dev *dev, size_t pos, size_t count, struct iov_iter *to)
+{
+    const char *buffptr;
+    size_t entry_size;
+    size_t entry_offset_byte = 0;
+    ssize_t retval = 0;
+    size_t to_copy;
+    size_t copied;
+
+    // Recorre entradas consecutivas hasta llenar 'count' o llegar al final del historial
+    while (count > 0 &&
+           aesd_snapshot_entry(dev, pos + retval, &buffptr, &entry_size, &entry_offset_byte))
+    {
+        // Disponible en esta entrada a partir de entry_offset
+        to_copy = entry_size - entry_offset_byte;
+
+        // Respeta 'count'
+        if (to_copy > count)
+            to_copy = count;
+
+        copied = copy_to_iter(buffptr + entry_offset_byte, to_copy, to);
+        retval += (ssize_t)copied;
+        if (copied != to_copy)
+        {
+            PDEBUG("copy to user failed");
+            // Si ya copiamos algo lo devolvemos; el siguiente read dará el error
+            if (retval == 0)
+                retval = -EFAULT;
+            break;
+        }
+
+        count -= to_copy;
+    }
+    return retval;
+}
+
+// Bytes del arena que se copian por cada toma de dev->lock
+#define AESD_ARENA_READ_CHUNK (64 * 1024)
+
+/**
+ * Lectura en modo arena: cada trozo de hasta AESD_ARENA_READ_CHUNK bytes
+ * ocupa como mucho dos tramos contiguos del anillo, que se copian con
+ * dev->lock tomado a un buffer intermedio; copy_to_iter se hace ya sin el
+ * mutex.
+ */
+static ssize_t aesd_read_arena(struct aesd_dev *dev, size_t pos, size_t count, struct iov_iter *to, bool nowait)
+{
+    const char *span_ptr[2];
+    size_t span_len[2];
+    size_t nspans;
+    size_t chunk;
+    size_t copied;
+    ssize_t retval = 0;
+    char *bounce;
+    size_t i;
+    int err;
+
+    if (count == 0)
+        return 0;
+    bounce = kvmalloc(min_t(size_t, count, AESD_ARENA_READ_CHUNK), GFP_KERNEL);
+    if (!bounce)
+        return -ENOMEM;
+
+    while (count > 0)
+    {
+        // Si el mutex no se puede tomar a mitad de lectura se devuelve lo ya copiado
+        err = aesd_reader_enter(dev, nowait);
+        if (err < 0)
+        {
+            if (retval == 0)
+                retval = err;
+            break;
+        }
+        chunk = 0;
+        nspans = aesd_circular_buffer_arena_spans(&dev->buffer, pos + retval,
+                                                  min_t(size_t, count, AESD_ARENA_READ_CHUNK), span_ptr, span_len);
+        for (i = 0; i < nspans; i++)
+        {
+            memcpy(bounce + chunk, span_ptr[i], span_len[i]);
+            chunk += span_len[i];
+        }
+        aesd_reader_exit(dev, err);
+
+        // Final del historial
+        if (chunk == 0)
+            break;
+
+        copied = copy_to_iter(bounce, chunk, to);
+        retval += (ssize_t)copied;
+        if (copied != chunk)
+        {
+            PDEBUG("copy to user failed");
+            if (retval == 0)
+                retval = -EFAULT;
+            break;
+        }
+        count -= chunk;
+    }
+
+    kvfree(bounce);
+    return retval;
+}
+
+ssize_t aesd_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+    struct aesd_file *file = iocb->ki_filp->private_data;
+    struct aesd_dev *dev;
+    size_t count = iov_iter_count(to);
+    ssize_t retval = 0;
+    u64 start;
+    int idx;
+
+    if (!file || !file->dev)
+    {
+        PDEBUG("dev invalid");
+        return -EINVAL;
+    }
+    dev = file->dev;
+
+    PDEBUG("read %zu bytes with offset %lld", count, iocb->ki_pos);
+
+    retval = aesd_sync_staged(dev, iocb->ki_flags & IOCB_NOWAIT);
+    if (retval)
+        return retval;
+
+    if (file->follow)
+        iocb->ki_pos = aesd_follow_pos(file, iocb->ki_pos);
+
+    /* Modo follow: al final del historial se espera al siguiente comando en
+     * lugar de devolver EOF (o -EAGAIN si el fichero es no bloqueante)
+     */
+    while (file->follow && count > 0 && !aesd_data_available(file, iocb->ki_pos))
+    {
+        if ((iocb->ki_filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT))
+            return -EAGAIN;
+        if (wait_event_interruptible(dev->readq, aesd_data_available(file, iocb->ki_pos)))
+            return -ERESTARTSYS;
+        retval = aesd_sync_staged(dev, false);
+        if (retval)
+            return retval;
+        iocb->ki_pos = aesd_follow_pos(file, iocb->ki_pos);
+    }
+
+    // La espera del modo follow no cuenta como latencia de lectura
+    start = ktime_get_ns();
+    if (dev->buffer.arena)
+    {
+        retval = aesd_read_arena(dev, (size_t)iocb->ki_pos, count, to, iocb->ki_flags & IOCB_NOWAIT);
+    }
+    else
+    {
+        idx = aesd_reader_enter(dev, iocb->ki_flags & IOCB_NOWAIT);
+        if (idx < 0)
+            return idx;
+        retval = aesd_read_entries(dev, (size_t)iocb->ki_pos, count, to);
+        aesd_reader_exit(dev, idx);
+    }
+
+    // Avanza el puntero de fichero con los bytes copiados
+    if (retval > 0)
+    {
+        iocb->ki_pos += retval;
+        aesd_stat_add(dev, read_bytes, retval);
+    }
+    aesd_stat_inc(dev, reads);
+    aesd_stat_inc(dev, read_lat[aesd_lat_bucket(ktime_get_ns() - start)]);
+    return retval;
+}
+
+/**
+ * Pone al día el área compartida con mmap. Si todo lo que muestra sigue en el
+ * historial y lo nuevo cabe detrás, sólo se añaden los comandos nuevos; si no
+ * (expulsión de un comando mapeado, área llena o primer mapeo) se reescribe
+ * con los comandos más recientes que quepan.
+ * Debe llamarse con dev->lock tomado.
+ */
+static void aesd_mmap_update(struct aesd_dev *dev)
+{
+    struct aesd_mmap_header *hdr = dev->mmap_area;
+    struct aesd_circular_buffer *buffer = &dev->buffer;
+    char *data;
+    size_t capacity;
+    size_t used;
+    size_t pos;
+    uint32_t entries;
+    const struct aesd_buffer_entry *entry;
+    size_t entry_offset_byte;
+
+    if (!hdr || dev->mmap_count == 0)
+        return;
+
+    data = (char *)hdr + hdr->header_size;
+    capacity = hdr->data_capacity;
+
+    // Generación impar: actualización en curso
+    WRITE_ONCE(hdr->generation, hdr->generation + 1);
+    smp_wmb();
+
+    if (dev->mmap_synced && dev->mmap_first_offs >= buffer->base_offs &&
+        hdr->data_size + (buffer->head_offs - dev->mmap_head_offs) <= capacity)
+    {
+        // Caso normal, un comando nuevo: se copia sólo lo que falta
+        used = hdr->data_size;
+        entries = hdr->entry_count;
+        pos = dev->mmap_head_offs - buffer->base_offs;
+    }
+    else
+    {
+        // Desde el comando más antiguo que cabe con todos los posteriores
+        used = 0;
+        entries = 0;
+        pos = aesd_circular_buffer_size(buffer);
+        pos = pos > capacity ? pos - capacity : 0;
+    }
+
+    entry = aesd_circular_buffer_find_entry_offset_for_fpos(buffer, pos, &entry_offset_byte);
+    // Un comando que empieza antes de pos no cabe entero
+    if (entry && entry_offset_byte)
+        entry = aesd_circular_buffer_next_entry(buffer, entry);
+    if (used == 0)
+        dev->mmap_first_offs = entry ? entry->end_offs - entry->size : buffer->head_offs;
+    for (; entry; entry = aesd_circular_buffer_next_entry(buffer, entry))
+    {
+        memcpy(data + used, entry->buffptr, entry->size);
+        used += entry->size;
+        entries++;
+    }
+    dev->mmap_head_offs = buffer->head_offs;
+    dev->mmap_synced = true;
+
+    WRITE_ONCE(hdr->data_size, used);
+    WRITE_ONCE(hdr->entry_count, entries);
+    WRITE_ONCE(hdr->flags, dev->mmap_first_offs > buffer->base_offs ? AESD_MMAP_TRUNCATED : 0);
+
+    smp_wmb();
+    WRITE_ONCE(hdr->generation, hdr->generation + 1);
+}
+
+static void aesd_vma_open(struct vm_area_struct *vma)
+{
+    struct aesd_dev *dev = vma->vm_private_data;
+
+    mutex_lock(&dev->lock);
+    dev->mmap_count++;
+    mutex_unlock(&dev->lock);
+}
+
+static void aesd_vma_close(struct vm_area_struct *vma)
+{
+    struct aesd_dev *dev = vma->vm_private_data;
+
+    mutex_lock(&dev->lock);
+    dev->mmap_count--;
+    mutex_unlock(&dev->lock);
+}
+
+static const struct vm_operations_struct aesd_vm_ops = {
+    .open = aesd_vma_open,
+    .close = aesd_vma_close,
+};
+
+/**
+ * Libera las entradas más antiguas hasta que el historial más @param incoming
+ * bytes quepa en dev->max_bytes. Debe llamarse con dev->lock tomado.
+ * El presupuesto cuenta bytes de comandos, no memoria reservada: cada entrada
+ * ocupa además una cabecera y, tras aesd_pending_trim, como mucho un cuarto
+ * más de su tamaño. Los comandos a medias de cada fichero abierto no cuentan;
+ * cada uno está acotado por separado a max_bytes.
+ */
+static void aesd_evict_to_budget(struct aesd_dev *dev, size_t incoming)
+{
+    if (dev->max_bytes == 0)
+        return;
+
+    while (aesd_circular_buffer_size(&dev->buffer) + incoming > dev->max_bytes &&
+           aesd_remove_oldest_locked(dev))
+        ;
+}
+
+/*
+ * Modo aesd_percpu_staging.
+ *
+ * Un write que trae un comando completo (termina en '\n' y el fichero no
+ * tiene otro a medias) no toma dev->lock: el comando se encola en la lista
+ * de la CPU actual con un número de secuencia global. Quien necesite el
+ * historial (read, ioctls de lectura, mmap, el siguiente escritor con mutex)
+ * fusiona antes todas las listas en orden de secuencia, así que todos los
+ * lectores ven el mismo orden. Los comandos a trozos siguen el camino normal.
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 13, 0)
+static int aesd_staged_cmp(void *priv, const struct list_head *a, const struct list_head *b)
+#else
+static int aesd_staged_cmp(void *priv, struct list_head *a, struct list_head *b)
+#endif
+{
+    u64 seq_a = list_entry(a, struct aesd_staged_entry, node)->seq;
+    u64 seq_b = list_entry(b, struct aesd_staged_entry, node)->seq;
+
+    return seq_a > seq_b ? 1 : (seq_a < seq_b ? -1 : 0);
+}
+
+/**
+ * Pasa al historial los comandos en stage de todas las CPUs.
+ * Debe llamarse con dev->lock tomado.
+ */
+static void aesd_merge_staged_locked(struct aesd_dev *dev)
+{
+    LIST_HEAD(merged);
+    struct aesd_staged_entry *staged, *tmp;
+    int cpu;
+
+    if (!dev->stage || atomic_read(&dev->staged) <= 0)
+        return;
+
+    for_each_possible_cpu(cpu)
+    {
+        struct aesd_stage *stage = per_cpu_ptr(dev->stage, cpu);
+
+        spin_lock(&stage->lock);
+        list_splice_tail_init(&stage->list, &merged);
+        spin_unlock(&stage->lock);
+    }
+    if (list_empty(&merged))
+        return;
+
+    // Cada lista ya está ordenada; list_sort es estable y lineal en ese caso
+    list_sort(NULL, &merged, aesd_staged_cmp);
+    list_for_each_entry_safe(staged, tmp, &merged, node)
+    {
+        list_del(&staged->node);
+        aesd_evict_to_budget(dev, staged->entry.size);
+        if (dev->buffer.arena)
+        {
+            aesd_add_arena_locked(dev, staged->entry.buffptr, staged->entry.size);
+            aesd_cmd_free(staged->entry.buffptr);
+        }
+        else
+        {
+            aesd_add_entry_locked(dev, &staged->entry);
+        }
+        atomic_dec(&dev->staged);
+        kfree(staged);
+    }
+    aesd_mmap_update(dev);
+}
+
+/**
+ * Fusiona los comandos en stage si los hay. Sin coste si el modo está
+ * desactivado o no hay nada pendiente.
+ */
+static int aesd_sync_staged(struct aesd_dev *dev, bool nowait)
+{
+    int retval;
+
+    if (!dev->stage || atomic_read(&dev->staged) <= 0)
+        return 0;
+
+    retval = aesd_dev_lock(dev, nowait);
+    if (retval)
+        return retval;
+    aesd_merge_staged_locked(dev);
+    mutex_unlock(&dev->lock);
+    return 0;
+}
+
+/**
+ * Mapea en solo lectura una copia del historial precedida de una
+ * struct aesd_mmap_header. La copia se mantiene al día en cada comando
+ * completado mientras exista algún mapeo, también con aesd_percpu_staging.
+ */
+int aesd_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+    struct aesd_dev *dev = ((struct aesd_file *)filp->private_data)->dev;
+    unsigned long len = vma->vm_end - vma->vm_start;
+    int retval;
+
+    if (vma->vm_pgoff != 0)
+        return -EINVAL;
+
+    // Sólo lectura: no se permite PROT_WRITE ni un mprotect posterior
+    if (vma->vm_flags & VM_WRITE)
+        return -EPERM;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+    vm_flags_clear(vma, VM_MAYWRITE);
+#else
+    vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+
+    retval = aesd_dev_lock(dev, false);
+    if (retval)
+        return retval;
+
+    if (!dev->mmap_area)
+    {
+        size_t area_size = PAGE_ALIGN(PAGE_SIZE + (size_t)aesd_mmap_data_size);
+
+        dev->mmap_area = vmalloc_user(area_size);
+        if (!dev->mmap_area)
+        {
+            retval = -ENOMEM;
+            goto out_unlock;
+        }
+        dev->mmap_area_size = area_size;
+        dev->mmap_area->magic = AESD_MMAP_MAGIC;
+        dev->mmap_area->header_size = PAGE_SIZE;
+        dev->mmap_area->data_capacity = area_size - PAGE_SIZE;
+    }
+
+    if (len > dev->mmap_area_size)
+    {
+        retval = -EINVAL;
+        goto out_unlock;
+    }
+
+    retval = remap_vmalloc_range(vma, dev->mmap_area, 0);
+    if (retval)
+        goto out_unlock;
+
+    vma->vm_ops = &aesd_vm_ops;
+    vma->vm_private_data = dev;
+
+    /* Con mmap_count publicado los escritores dejan de usar el stage; lo que
+     * ya esté en él se fusiona ahora (ver aesd_stage_pending)
+     */
+    dev->mmap_count++;
+    smp_mb();
+    aesd_merge_staged_locked(dev);
+    // Primer mapeo: la copia puede estar desactualizada, se regenera
+    if (dev->mmap_count == 1)
+    {
+        dev->mmap_synced = false;
+        aesd_mmap_update(dev);
+    }
+
+out_unlock:
+    mutex_unlock(&dev->lock);
+    return retval;
+}
+
+/**
+ * Asegura que el pending_buf de @param file tenga sitio para @param needed bytes.
+ * La primera reserva de un comando es exacta (el caso normal es un comando
+ * en un solo write); después la capacidad se duplica, de modo que un comando
+ * que llega en muchos trozos se copia un número amortizado constante de veces.
+ * Debe llamarse con file->lock tomado.
+ */
+static int aesd_pending_reserve(struct aesd_file *file, size_t needed, gfp_t gfp)
+{
+    size_t max_bytes = READ_ONCE(file->dev->max_bytes);
+    size_t new_alloc;
+    char *new_buf;
+
+    if (needed <= file->pending_alloc)
+        return 0;
+
+    new_alloc = max_t(size_t, needed, file->pending_alloc * 2);
+    if (max_bytes && new_alloc > max_bytes)
+        new_alloc = max_t(size_t, needed, max_bytes);
+
+    new_buf = aesd_cmd_alloc(new_alloc, gfp);
+    if (!new_buf)
+        return -ENOMEM;
+
+    if (file->pending_size)
+        memcpy(new_buf, file->pending_buf, file->pending_size);
+    aesd_cmd_free(file->pending_buf);
+    file->pending_buf = new_buf;
+    file->pending_alloc = new_alloc;
+    return 0;
+}
+
+/**
+ * Antes de entregar un comando de @param size bytes al historial, recorta
+ * pending_buf de @param file si el crecimiento geométrico dejó más de un
+ * cuarto de capacidad sin usar, para que el historial no retenga memoria
+ * ociosa. Sin memoria para la copia exacta se entrega tal cual.
+ * Debe llamarse con file->lock tomado y sin dev->lock: copia el comando entero.
+ */
+static void aesd_pending_trim(struct aesd_file *file, size_t size, gfp_t gfp)
+{
+    char *trimmed;
+
+    if (file->pending_alloc - size <= size / 4)
+        return;
+
+    trimmed = aesd_cmd_alloc(size, gfp);
+    if (!trimmed)
+        return;
+    memcpy(trimmed, file->pending_buf, size);
+    aesd_cmd_free(file->pending_buf);
+    file->pending_buf = trimmed;
+    file->pending_alloc = size;
+}
 
-int aesd_open(struct inode *inode, struct file *filp)
+/**
+ * Entrega el comando pendiente de @param file como buffer propio y deja
+ * pending vacío. Debe llamarse con file->lock tomado.
+ */
+static char *aesd_pending_detach(struct aesd_file *file)
 {
-    PDEBUG("open");
-    /**
-     * TODO: handle open
-     */
-    struct aesd_dev *dev;
-    dev = container_of(inode->i_cdev, struct aesd_dev, cdev);
-    filp->private_data = dev;
+    char *buf = file->pending_buf;
 
-    return 0;
+    file->pending_buf = NULL;
+    file->pending_size = 0;
+    file->pending_alloc = 0;
+    return buf;
 }
 
-int aesd_release(struct inode *inode, struct file *filp)
+/**
+ * Camino rápido de escritura en modo aesd_percpu_staging: encola en la CPU
+ * actual el comando completo de @param size bytes que hay en pending_buf, sin
+ * copiarlo otra vez ni tomar dev->lock.
+ * Mientras haya mapeos no se usa: la copia compartida debe reflejar cada
+ * comando en cuanto se completa, y eso exige el mutex.
+ * Debe llamarse con file->lock tomado.
+ * @return 1 si el comando quedó en stage, 0 si debe seguir el camino con
+ *      mutex o un error negativo; salvo con 1, pending_buf queda como estaba
+ */
+static int aesd_stage_pending(struct aesd_dev *dev, struct aesd_file *file, size_t size, bool nowait)
 {
-    PDEBUG("release");
-    /**
-     * TODO: handle release
-     */
+    gfp_t gfp = nowait ? GFP_NOWAIT : GFP_KERNEL;
+    struct aesd_staged_entry *staged;
+    struct aesd_stage *stage;
+    int retval;
 
-    return 0;
+    if (READ_ONCE(dev->mmap_count))
+        return 0;
+
+    // Si nadie lee, el stage tampoco debe crecer más que el propio historial
+    if (atomic_read(&dev->staged) >= (int)READ_ONCE(dev->buffer.capacity))
+    {
+        retval = aesd_sync_staged(dev, nowait);
+        if (retval)
+            return retval;
+    }
+
+    staged = kmalloc(sizeof(*staged), gfp);
+    if (!staged)
+        return nowait ? -EAGAIN : -ENOMEM;
+    aesd_pending_trim(file, size, gfp);
+    file->pending_size = size;
+    staged->entry.size = size;
+    staged->entry.buffptr = aesd_pending_detach(file);
+    staged->entry.end_offs = 0;
+
+    stage = get_cpu_ptr(dev->stage);
+    spin_lock(&stage->lock);
+    staged->seq = atomic64_inc_return(&dev->stage_seq);
+    list_add_tail(&staged->node, &stage->list);
+    // Dentro del lock: staged nunca es menor que lo que hay en las listas
+    atomic_inc(&dev->staged);
+    spin_unlock(&stage->lock);
+    put_cpu_ptr(dev->stage);
+
+    wake_up_interruptible_all(&dev->readq);
+
+    /* Emparejado con el smp_mb() de aesd_mmap: si un primer mapeo llegó
+     * después de comprobar mmap_count, o aesd_mmap ve este comando al
+     * fusionar o lo vemos mapeado aquí y lo fusionamos. El comando ya está
+     * escrito, así que aquí no se puede fallar: se espera al mutex aunque
+     * sea nowait (sólo en esa carrera con el primer mmap).
+     */
+    smp_mb();
+    if (READ_ONCE(dev->mmap_count))
+    {
+        mutex_lock(&dev->lock);
+        aesd_merge_staged_locked(dev);
+        mutex_unlock(&dev->lock);
+    }
+    return 1;
 }
 
-ssize_t aesd_read(struct file *filp, char __user *buf, size_t count, loff_t *f_pos)
+/*
+ * Cada fichero abierto acumula su propio comando a medias bajo file->lock, así
+ * que escritores en ficheros distintos copian sus datos en paralelo y sin
+ * mezclarse. Sólo la entrega del comando completo al historial toma dev->lock.
+ */
+ssize_t aesd_write_iter(struct kiocb *iocb, struct iov_iter *from)
 {
+    struct aesd_file *file = iocb->ki_filp->private_data;
     struct aesd_dev *dev;
-    const struct aesd_buffer_entry *entry;
-    size_t entry_offset_byte = 0;
+    bool nowait = iocb->ki_flags & IOCB_NOWAIT;
     ssize_t retval = 0;
-    size_t to_copy;
+    size_t count = iov_iter_count(from);
+    size_t max_bytes;
+    size_t new_size;
+    struct aesd_buffer_entry new_entry;
+    u64 start = ktime_get_ns();
 
-    PDEBUG("read %zu bytes with offset %lld", count, *f_pos);
-    /**
-     * TODO: handle read
-     */
+    PDEBUG("write %zu bytes with offset %lld", count, iocb->ki_pos);
 
-    if (!buf)
-    {
-        PDEBUG("buf invalid");
+    if (count == 0)
         return -EINVAL;
-    }
 
-    dev = filp->private_data;
-    if (!dev)
-    {
-        PDEBUG("dev invalid");
+    if (!file || !file->dev)
         return -EINVAL;
-    }
-
-    PDEBUG("read %zu bytes with offset %lld", count, *f_pos);
+    dev = file->dev;
 
-    if (mutex_lock_interruptible(&dev->lock))
+    if (nowait)
+    {
+        if (!mutex_trylock(&file->lock))
+            return -EAGAIN;
+    }
+    else if (mutex_lock_interruptible(&file->lock))
     {
-        PDEBUG("mutex not acquired");
         return -ERESTARTSYS;
     }
 
-    // Traduce *f_pos a (entrada, offset dentro de la entrada)
-    entry = aesd_circular_buffer_find_entry_offset_for_fpos(&dev->buffer, (size_t)*f_pos, &entry_offset_byte);
+    /* Los datos se copian directamente desde el iov_iter al final de
+     * pending_buf, sin buffer intermedio. Si la escritura termina en '\n',
+     * pending_buf pasa tal cual a ser la entrada del buffer circular.
+     */
+    new_size = file->pending_size + count;
+    max_bytes = READ_ONCE(dev->max_bytes);
+    // Un comando mayor que todo el presupuesto (o que el arena) no cabría nunca en el historial
+    if ((max_bytes && new_size > max_bytes) || (dev->buffer.arena && new_size > dev->buffer.arena_size))
+    {
+        retval = -EFBIG;
+        goto out_unlock_file;
+    }
+    if (aesd_pending_reserve(file, new_size, nowait ? GFP_NOWAIT : GFP_KERNEL))
+    {
+        retval = nowait ? -EAGAIN : -ENOMEM;
+        goto out_unlock_file;
+    }
 
-    if (!entry)
+    if (!copy_from_iter_full(file->pending_buf + file->pending_size, count, from))
     {
-        PDEBUG("entry not found");
-        // No hay datos a partir de *f_pos => EOF
-        retval = 0;
-        goto out_unlock;
+        // pending_size no cambia: los bytes copiados a medias se descartan
+        retval = -EFAULT;
+        goto out_unlock_file;
     }
 
-    // Disponible en esta entrada a partir de entry_offset
-    to_copy = entry->size - entry_offset_byte;
+    if (file->pending_buf[new_size - 1] == '\n')
+    {
+        // Un comando completo en un solo write va al stage de la CPU, sin dev->lock
+        if (dev->stage && file->pending_size == 0)
+        {
+            retval = aesd_stage_pending(dev, file, new_size, nowait);
+            if (retval < 0)
+                goto out_unlock_file;
+            if (retval > 0)
+            {
+                retval = count;
+                goto out_unlock_file;
+            }
+        }
+
+        if (!dev->buffer.arena)
+            aesd_pending_trim(file, new_size, nowait ? GFP_NOWAIT : GFP_KERNEL);
 
-    // Respeta 'count'
-    if (to_copy > count)
-        to_copy = count;
+        // Si no se consigue el mutex pending_size no cambia y el write no tiene efecto
+        retval = aesd_dev_lock(dev, nowait);
+        if (retval)
+            goto out_unlock_file;
+
+        aesd_stat_add(dev, pending_bytes, -(long)file->pending_size);
+        // Los comandos en stage se completaron antes que este
+        aesd_merge_staged_locked(dev);
+        aesd_evict_to_budget(dev, new_size);
+        if (dev->buffer.arena)
+        {
+            /* Se copia al arena; pending_buf se queda para el siguiente comando */
+            aesd_add_arena_locked(dev, file->pending_buf, new_size);
+            file->pending_size = 0;
+        }
+        else
+        {
+            /* Entregamos pending_buf al buffer circular (NO lo liberamos después) */
+            file->pending_size = new_size;
+            new_entry.size = new_size;
+            new_entry.buffptr = aesd_pending_detach(file);
+            aesd_add_entry_locked(dev, &new_entry);
+        }
+        aesd_mmap_update(dev);
 
-    if (copy_to_user(buf, entry->buffptr + entry_offset_byte, to_copy))
+        mutex_unlock(&dev->lock);
+    }
+    else
     {
-        PDEBUG("copy to user failed");
-        retval = -EFAULT;
-        goto out_unlock;
+        file->pending_size = new_size;
+        aesd_stat_add(dev, pending_bytes, (long)count);
     }
 
-    // Avanza el puntero de fichero y devuelve bytes copiados
-    *f_pos += to_copy;
-    retval = (ssize_t)to_copy;
+    retval = count;
 
-out_unlock:
-    mutex_unlock(&dev->lock);
+out_unlock_file:
+    mutex_unlock(&file->lock);
+    if (retval > 0)
+    {
+        aesd_stat_inc(dev, writes);
+        aesd_stat_add(dev, write_bytes, retval);
+        aesd_stat_inc(dev, write_lat[aesd_lat_bucket(ktime_get_ns() - start)]);
+    }
     return retval;
 }
 
-ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count, loff_t *f_pos)
+/**
+ * Cambia el número de comandos que guarda el historial. Si se reduce, se
+ * liberan las entradas más antiguas que ya no caben.
+ * Debe llamarse sin dev->lock: toma dev->resize_lock y después dev->lock.
+ */
+static int aesd_set_max_entries(struct aesd_dev *dev, size_t max_entries)
 {
-    struct aesd_dev *dev;
-    ssize_t retval = 0;
-    char *kbuf = NULL;
-
-    struct aesd_buffer_entry new_entry;
-    size_t total_size;
-    char *combined = NULL;
-
-    PDEBUG("write %zu bytes with offset %lld", count, *f_pos);
-
-    if (!buf || count == 0)
-        return -EINVAL;
+    struct aesd_buffer_entry *entries;
+    struct aesd_buffer_entry *old_entries = NULL;
+    bool resized = false;
+    int retval;
 
-    dev = filp->private_data;
-    if (!dev)
+    if (max_entries == 0 || max_entries > AESDCHAR_MAX_CAPACITY)
         return -EINVAL;
 
-    if (mutex_lock_interruptible(&dev->lock))
-        return -ERESTARTSYS;
-
-    kbuf = kmalloc(count, GFP_KERNEL);
-    if (!kbuf)
-    {
-        retval = -ENOMEM;
-        goto out_unlock;
-    }
+    entries = kvcalloc(max_entries, sizeof(*entries), GFP_KERNEL);
+    if (!entries)
+        return -ENOMEM;
 
-    if (copy_from_user(kbuf, buf, count))
+    if (mutex_lock_interruptible(&dev->resize_lock))
     {
-        retval = -EFAULT;
-        goto out_free_kbuf;
+        kvfree(entries);
+        return -ERESTARTSYS;
     }
 
-    /* Si la escritura termina en '\n', debemos "cerrar" un comando:
-     * - concatenar cualquier pending_buf + kbuf
-     * - añadir como UNA entrada al buffer circular
-     * - limpiar pending_buf
+    /* El array de entradas y su capacidad cambian a la vez: los lectores no
+     * pueden validar eso con el seqcount sin riesgo de indexar fuera del
+     * array, así que se les aparta (esperan en readq) mientras tanto. El
+     * periodo de gracia se espera antes de tomar dev->lock: un lector puede
+     * estar en copy_to_iter esperando a mmap_lock, y quien tiene mmap_lock
+     * (aesd_mmap) puede estar esperando a dev->lock.
      */
-    if (kbuf[count - 1] == '\n')
-    {
-        total_size = dev->pending_size + count;
+    WRITE_ONCE(dev->resizing, true);
+    synchronize_srcu(&aesd_srcu);
+
+    retval = aesd_dev_lock(dev, false);
+    if (retval)
+        goto out_resizing;
+
+    while (aesd_circular_buffer_count(&dev->buffer) > max_entries && aesd_remove_oldest_locked(dev))
+        ;
+    resized = aesd_circular_buffer_resize(&dev->buffer, entries, max_entries, &old_entries);
+    if (resized)
+        aesd_mmap_update(dev);
+    else
+        retval = -EINVAL;
+    mutex_unlock(&dev->lock);
 
-        combined = kmalloc(total_size, GFP_KERNEL);
-        if (!combined)
-        {
-            retval = -ENOMEM;
-            goto out_free_kbuf;
-        }
+out_resizing:
+    WRITE_ONCE(dev->resizing, false);
+    wake_up_interruptible_all(&dev->readq);
+    mutex_unlock(&dev->resize_lock);
 
-        /* Copia lo pendiente primero, luego lo nuevo */
-        if (dev->pending_buf && dev->pending_size)
-            memcpy(combined, dev->pending_buf, dev->pending_size);
+    kvfree(resized ? old_entries : entries);
+    return retval;
+}
 
-        memcpy(combined + dev->pending_size, kbuf, count);
+/**
+ * Copia los rangos de @param req, uno tras otro, a un buffer intermedio que
+ * devuelve en *@param bounce_rtn (el llamante lo libera con kvfree). Con el
+ * mutex de los escritores tomado el historial no cambia durante toda la
+ * petición; la copia al buffer de usuario se hace después de soltarlo.
+ * @return total de bytes copiados o -ENOMEM
+ */
+static long aesd_seekread_locked(struct aesd_dev *dev, struct aesd_seekread_range *ranges,
+                                 const struct aesd_seekread *req, char **bounce_rtn)
+{
+    char *bounce;
+    size_t total = 0;
+    uint32_t i;
 
-        /* Liberamos el buffer pendiente, ya consumido */
-        kfree(dev->pending_buf);
-        dev->pending_buf = NULL;
-        dev->pending_size = 0;
+    for (i = 0; i < req->range_count; i++)
+    {
+        struct aesd_seekread_range *range = &ranges[i];
+        struct aesd_buffer_entry *entry;
+        size_t fpos;
+        size_t n;
+
+        range->bytes_read = 0;
+        entry = aesd_circular_buffer_find_fpos_for_entry(&dev->buffer, range->write_cmd,
+                                                         range->write_cmd_offset, &fpos);
+        // Comando inexistente o ya expulsado: rango vacío, se sigue con el resto
+        if (!entry)
+            continue;
+
+        n = min_t(size_t, range->length, entry->size - range->write_cmd_offset);
+        n = min_t(size_t, n, req->buf_len - total);
+        range->bytes_read = n;
+        total += n;
+    }
 
-        /* Entregamos 'combined' al buffer circular (NO lo liberamos después) */
-        new_entry.buffptr = combined;
-        new_entry.size = total_size;
-        aesd_circular_buffer_add_entry(&dev->buffer, &new_entry);
+    *bounce_rtn = NULL;
+    if (total == 0)
+        return 0;
+    bounce = kvmalloc(total, GFP_KERNEL);
+    if (!bounce)
+        return -ENOMEM;
 
-        /* Importante: NO liberar 'combined', ahora es propiedad del buffer */
-        retval = count;
-    }
-    else
+    // Segunda pasada con el historial intacto: los rangos resuelven a las mismas entradas
+    total = 0;
+    for (i = 0; i < req->range_count; i++)
     {
-        /* Acumular escritura parcial (sin '\n') en pending_buf */
-        size_t new_size = dev->pending_size + count;
-        char *new_buf = krealloc(dev->pending_buf, new_size, GFP_KERNEL);
-        if (!new_buf)
-        {
-            retval = -ENOMEM;
-            goto out_free_kbuf;
-        }
-        memcpy(new_buf + dev->pending_size, kbuf, count);
-        dev->pending_buf = new_buf;
-        dev->pending_size = new_size;
+        struct aesd_seekread_range *range = &ranges[i];
+        struct aesd_buffer_entry *entry;
+        size_t fpos;
+
+        if (range->bytes_read == 0)
+            continue;
+        entry = aesd_circular_buffer_find_fpos_for_entry(&dev->buffer, range->write_cmd,
+                                                         range->write_cmd_offset, &fpos);
+        memcpy(bounce + total, entry->buffptr + range->write_cmd_offset, range->bytes_read);
+        total += range->bytes_read;
+    }
 
-        retval = count;
+    *bounce_rtn = bounce;
+    return total;
+}
+
+static long aesd_ioctl_seekread(struct aesd_dev *dev, void __user *arg)
+{
+    struct aesd_seekread req;
+    struct aesd_seekread_range *ranges;
+    char *bounce = NULL;
+    size_t ranges_size;
+    long retval;
+
+    if (copy_from_user(&req, arg, sizeof(req)))
+        return -EFAULT;
+
+    PDEBUG("AESDCHAR_IOCSEEKREAD ioctl called: %u ranges, %llu bytes", req.range_count,
+           (unsigned long long)req.buf_len);
+    if (req.range_count == 0 || req.range_count > AESD_SEEKREAD_MAX_RANGES)
+        return -EINVAL;
+
+    ranges_size = req.range_count * sizeof(*ranges);
+    ranges = kvmalloc(ranges_size, GFP_KERNEL);
+    if (!ranges)
+        return -ENOMEM;
+    if (copy_from_user(ranges, u64_to_user_ptr(req.ranges), ranges_size))
+    {
+        retval = -EFAULT;
+        goto out_free;
     }
 
-out_free_kbuf:
-    kfree(kbuf);
-out_unlock:
+    // Una sola adquisición del mutex para todos los rangos
+    retval = aesd_dev_lock(dev, false);
+    if (retval)
+        goto out_free;
+    aesd_merge_staged_locked(dev);
+    retval = aesd_seekread_locked(dev, ranges, &req, &bounce);
     mutex_unlock(&dev->lock);
+
+    if (retval > 0 && copy_to_user(u64_to_user_ptr(req.buf), bounce, retval))
+        retval = -EFAULT;
+    if (retval >= 0 && copy_to_user(u64_to_user_ptr(req.ranges), ranges, ranges_size))
+        retval = -EFAULT;
+
+out_free:
+    kvfree(bounce);
+    kvfree(ranges);
     return retval;
 }
 
 long aesd_unlocked_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 {
-    struct aesd_dev *dev = filp->private_data;
+    struct aesd_file *file = filp->private_data;
+    struct aesd_dev *dev = file->dev;
     struct aesd_seekto seekto;
     struct aesd_buffer_entry *entry;
-    size_t entry_offset_byte = 0;
     size_t fpos = 0;
-    uint32_t write_cmd_count = 0;
-
-    if (mutex_lock_interruptible(&dev->lock))
-    {
-        return -ERESTARTSYS;
-    }
 
     if (cmd == AESDCHAR_IOCSEEKTO)
     {
+        size_t base = 0;
+        unsigned int seq;
+        int idx;
+
         PDEBUG("AESDCHAR_IOCSEEKTO ioctl called");
         if (copy_from_user(&seekto, (const void __user *)arg, sizeof(seekto)))
         {
             PDEBUG("copy_from_user failed");
-            mutex_unlock(&dev->lock);
             return -EFAULT;
         }
 
         PDEBUG("ioctl seekto: write_cmd=%u, write_cmd_offset=%u", seekto.write_cmd, seekto.write_cmd_offset);
 
-        // Calcular cuántas entradas válidas hay en el buffer
-        uint8_t num_entries = 0;
-        if (dev->buffer.full)
-        {
-            num_entries = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
-        }
-        else
-        {
-            // Si no está lleno, el número de entradas es la diferencia
-            if (dev->buffer.in_offs >= dev->buffer.out_offs)
-                num_entries = dev->buffer.in_offs - dev->buffer.out_offs;
-            else
-                num_entries = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED - dev->buffer.out_offs + dev->buffer.in_offs;
-        }
+        idx = aesd_sync_staged(dev, false);
+        if (idx)
+            return idx;
 
-        // Verificar que write_cmd es válido
-        if (seekto.write_cmd >= num_entries)
+        // Sólo lee el índice del buffer: no hace falta el mutex de los escritores
+        idx = aesd_reader_enter(dev, false);
+        if (idx < 0)
+            return idx;
+        do
         {
-            PDEBUG("Invalid write_cmd: %u >= %u entries", seekto.write_cmd, num_entries);
-            mutex_unlock(&dev->lock);
-            return -EINVAL;
-        }
-
-        // Calcular el índice de la entrada solicitada
-        uint8_t entry_index = (dev->buffer.out_offs + seekto.write_cmd) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
-        entry = &dev->buffer.entry[entry_index];
-
-        // Verificar que el offset está dentro del rango de la entrada
-        if (seekto.write_cmd_offset >= entry->size)
+            seq = read_seqcount_begin(&dev->seq);
+            // Índice acumulado del buffer: traduce (write_cmd, offset) a fpos sin recorrer las entradas
+            entry = aesd_circular_buffer_find_fpos_for_entry(&dev->buffer, seekto.write_cmd,
+                                                             seekto.write_cmd_offset, &fpos);
+            base = dev->buffer.base_offs;
+        } while (read_seqcount_retry(&dev->seq, seq));
+        aesd_reader_exit(dev, idx);
+
+        if (!entry)
         {
-            PDEBUG("Invalid offset: %u >= %zu", seekto.write_cmd_offset, entry->size);
-            mutex_unlock(&dev->lock);
+            PDEBUG("Invalid seek: write_cmd=%u offset=%u", seekto.write_cmd, seekto.write_cmd_offset);
             return -EINVAL;
         }
 
-        // Calcular fpos: suma de tamaños de todas las entradas anteriores + offset dentro de la entrada actual
-        fpos = 0;
-        for (write_cmd_count = 0; write_cmd_count < seekto.write_cmd; write_cmd_count++)
-        {
-            uint8_t idx = (dev->buffer.out_offs + write_cmd_count) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
-            fpos += dev->buffer.entry[idx].size;
-        }
-        fpos += seekto.write_cmd_offset;
-
         PDEBUG("Seeking to fpos=%zu", fpos);
+        // fpos es relativa al historial de la instantánea: el modo follow parte de ella
+        file->follow_base = base;
         filp->f_pos = fpos;
+        return 0;
+    }
+
+    if (cmd == AESDCHAR_IOCSETFOLLOW)
+    {
+        uint32_t follow;
+
+        if (copy_from_user(&follow, (const void __user *)arg, sizeof(follow)))
+            return -EFAULT;
+
+        PDEBUG("AESDCHAR_IOCSETFOLLOW ioctl called: %u", follow);
+        // f_pos sigue siendo relativa al historial actual
+        file->follow_base = READ_ONCE(dev->buffer.base_offs);
+        file->follow = follow != 0;
+        return 0;
+    }
+
+    if (cmd == AESDCHAR_IOCSEEKREAD)
+        return aesd_ioctl_seekread(dev, (void __user *)arg);
+
+    // Los argumentos se copian antes de tomar dev->lock: ver el orden de locks
+    if (cmd == AESDCHAR_IOCSETMAXENTRIES)
+    {
+        uint32_t max_entries;
+
+        if (copy_from_user(&max_entries, (const void __user *)arg, sizeof(max_entries)))
+            return -EFAULT;
+
+        PDEBUG("AESDCHAR_IOCSETMAXENTRIES ioctl called: %u", max_entries);
+        return aesd_set_max_entries(dev, max_entries);
+    }
+    else if (cmd == AESDCHAR_IOCSETMAXBYTES)
+    {
+        uint64_t max_bytes;
+
+        if (copy_from_user(&max_bytes, (const void __user *)arg, sizeof(max_bytes)))
+            return -EFAULT;
+
+        PDEBUG("AESDCHAR_IOCSETMAXBYTES ioctl called: %llu", (unsigned long long)max_bytes);
+        if (aesd_dev_lock(dev, false))
+            return -ERESTARTSYS;
+        dev->max_bytes = (size_t)max_bytes;
+        aesd_evict_to_budget(dev, 0);
+        aesd_mmap_update(dev);
 
         mutex_unlock(&dev->lock);
         return 0;
     }
     else
     {
-        mutex_unlock(&dev->lock);
         return -ENOTTY;
     }
 }
 
+/**
+ * Hay datos para leer (EPOLLIN) si el historial tiene bytes a partir de
+ * f_pos; cada comando completado despierta a quien espere en poll/epoll.
+ * Escribir nunca bloquea.
+ */
+__poll_t aesd_poll(struct file *filp, poll_table *wait)
+{
+    struct aesd_file *file = filp->private_data;
+    __poll_t mask = EPOLLOUT | EPOLLWRNORM;
+    loff_t pos = filp->f_pos;
+
+    poll_wait(filp, &file->dev->readq, wait);
+
+    /* Sin aesd_follow_pos: poll no puede mover follow_base sin reajustar
+     * f_pos, o el siguiente read no descontaría los bytes expulsados
+     */
+    if (aesd_data_available(file, pos))
+        mask |= EPOLLIN | EPOLLRDNORM;
+
+    return mask;
+}
+
 loff_t aesd_llseek(struct file *filp, loff_t off, int whence)
 {
-    struct aesd_dev *dev = (struct aesd_dev *)filp->private_data;
+    struct aesd_file *file = filp->private_data;
     loff_t newpos;
 
     switch (whence)
@@ -324,23 +1402,105 @@ loff_t aesd_llseek(struct file *filp, loff_t off, int whence)
     if (newpos < 0)
         return -EINVAL;
 
+    // La nueva posición es relativa al historial actual, también en modo follow
+    if (file)
+        file->follow_base = READ_ONCE(file->dev->buffer.base_offs);
     filp->f_pos = newpos;
     return newpos;
 }
 
 struct file_operations aesd_fops = {
     .owner = THIS_MODULE,
-    .read = aesd_read,
-    .write = aesd_write,
+    .read_iter = aesd_read_iter,
+    .write_iter = aesd_write_iter,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+    .splice_read = copy_splice_read,
+#else
+    .splice_read = generic_file_splice_read,
+#endif
+    .splice_write = iter_file_splice_write,
     .open = aesd_open,
     .release = aesd_release,
     .llseek = aesd_llseek,
     .unlocked_ioctl = aesd_unlocked_ioctl,
+    .mmap = aesd_mmap,
+    .poll = aesd_poll,
 };
 
-static int aesd_setup_cdev(struct aesd_dev *dev)
+/*
+ * Estadísticas en debugfs: /sys/kernel/debug/aesdchar/<minor>/stats
+ */
+static int aesd_stats_show(struct seq_file *s, void *unused)
+{
+    struct aesd_dev *dev = s->private;
+    struct aesd_stats total = {0};
+    unsigned int b;
+    int cpu;
+
+    for_each_possible_cpu(cpu)
+    {
+        const struct aesd_stats *stats = per_cpu_ptr(dev->stats, cpu);
+
+        total.reads += stats->reads;
+        total.read_bytes += stats->read_bytes;
+        total.writes += stats->writes;
+        total.write_bytes += stats->write_bytes;
+        total.commits += stats->commits;
+        total.evictions += stats->evictions;
+        total.pending_bytes += stats->pending_bytes;
+        total.lock_contended += stats->lock_contended;
+        total.lock_wait_ns += stats->lock_wait_ns;
+        for (b = 0; b < AESD_LAT_BUCKETS; b++)
+        {
+            total.read_lat[b] += stats->read_lat[b];
+            total.write_lat[b] += stats->write_lat[b];
+        }
+    }
+
+    seq_printf(s, "reads: %llu\n", total.reads);
+    seq_printf(s, "read_bytes: %llu\n", total.read_bytes);
+    seq_printf(s, "writes: %llu\n", total.writes);
+    seq_printf(s, "write_bytes: %llu\n", total.write_bytes);
+    seq_printf(s, "commits: %llu\n", total.commits);
+    seq_printf(s, "evictions: %llu\n", total.evictions);
+    seq_printf(s, "pending_bytes: %ld\n", total.pending_bytes);
+    seq_printf(s, "lock_contended: %llu\n", total.lock_contended);
+    seq_printf(s, "lock_wait_ns: %llu\n", total.lock_wait_ns);
+
+    // Estado actual del historial, lecturas sin lock: sólo orientativas
+    seq_printf(s, "entries: %zu\n", aesd_circular_buffer_count(&dev->buffer));
+    seq_printf(s, "capacity: %zu\n", READ_ONCE(dev->buffer.capacity));
+    seq_printf(s, "bytes: %zu\n", aesd_circular_buffer_size(&dev->buffer));
+    seq_printf(s, "max_bytes: %zu\n", READ_ONCE(dev->max_bytes));
+    if (dev->stage)
+        seq_printf(s, "staged: %d\n", atomic_read(&dev->staged));
+
+    seq_puts(s, "latency_ns read write\n");
+    for (b = 0; b < AESD_LAT_BUCKETS; b++)
+    {
+        if (b == AESD_LAT_BUCKETS - 1)
+            seq_printf(s, ">=%llu", 1ULL << (10 + b - 1));
+        else
+            seq_printf(s, "<%llu", 1ULL << (10 + b));
+        seq_printf(s, " %llu %llu\n", total.read_lat[b], total.write_lat[b]);
+    }
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(aesd_stats);
+
+static void aesd_debugfs_add(struct aesd_dev *dev, unsigned int index)
+{
+    char name[16];
+
+    // debugfs es opcional: sus errores no impiden cargar el driver
+    snprintf(name, sizeof(name), "%u", aesd_minor + index);
+    dev->debugfs_dir = debugfs_create_dir(name, aesd_debugfs_root);
+    debugfs_create_file("stats", 0444, dev->debugfs_dir, dev, &aesd_stats_fops);
+}
+
+static int aesd_setup_cdev(struct aesd_dev *dev, unsigned int index)
 {
-    int err, devno = MKDEV(aesd_major, aesd_minor);
+    int err, devno = MKDEV(aesd_major, aesd_minor + index);
 
     cdev_init(&dev->cdev, &aesd_fops);
     dev->cdev.owner = THIS_MODULE;
@@ -348,66 +1508,220 @@ static int aesd_setup_cdev(struct aesd_dev *dev)
     err = cdev_add(&dev->cdev, devno, 1);
     if (err)
     {
-        printk(KERN_ERR "Error %d adding aesd cdev", err);
+        printk(KERN_ERR "Error %d adding aesd cdev %u", err, index);
     }
     return err;
 }
 
+static int aesd_dev_init(struct aesd_dev *dev)
+{
+    int result;
+    int cpu;
+
+    mutex_init(&dev->lock);
+    mutex_init(&dev->resize_lock);
+    seqcount_mutex_init(&dev->seq, &dev->lock);
+    init_waitqueue_head(&dev->readq);
+    aesd_circular_buffer_init(&dev->buffer);
+    dev->max_bytes = aesd_max_bytes;
+
+    dev->stats = alloc_percpu(struct aesd_stats);
+    if (!dev->stats)
+        return -ENOMEM;
+
+    if (aesd_max_entries != AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED)
+    {
+        // Aún no hay cdev, pero toma los locks igual: abre secciones de escritura de dev->seq
+        result = aesd_set_max_entries(dev, aesd_max_entries);
+        if (result)
+        {
+            printk(KERN_ERR "aesdchar: invalid aesd_max_entries %u\n", aesd_max_entries);
+            goto fail_stats;
+        }
+    }
+
+    if (aesd_arena_size)
+    {
+        char *arena = vmalloc(aesd_arena_size);
+
+        if (!arena)
+        {
+            result = -ENOMEM;
+            goto fail_entries;
+        }
+        aesd_circular_buffer_set_arena(&dev->buffer, arena, aesd_arena_size);
+    }
+
+    if (aesd_percpu_staging)
+    {
+        dev->stage = alloc_percpu(struct aesd_stage);
+        if (!dev->stage)
+        {
+            result = -ENOMEM;
+            goto fail_arena;
+        }
+        for_each_possible_cpu(cpu)
+        {
+            struct aesd_stage *stage = per_cpu_ptr(dev->stage, cpu);
+
+            spin_lock_init(&stage->lock);
+            INIT_LIST_HEAD(&stage->list);
+        }
+        atomic_set(&dev->staged, 0);
+        atomic64_set(&dev->stage_seq, 0);
+    }
+
+    return 0;
+
+fail_arena:
+    vfree(dev->buffer.arena);
+    dev->buffer.arena = NULL;
+fail_entries:
+    if (dev->buffer.entry != dev->buffer.default_entry)
+        kvfree(dev->buffer.entry);
+fail_stats:
+    free_percpu(dev->stats);
+    dev->stats = NULL;
+    return result;
+}
+
+/**
+ * Libera todo lo que guarda @param dev. El cdev ya debe estar eliminado y las
+ * liberaciones diferidas completadas (srcu_barrier).
+ */
+static void aesd_dev_cleanup(struct aesd_dev *dev)
+{
+    struct aesd_buffer_entry *entry;
+    size_t i;
+    int cpu;
+
+    /* Comandos en stage que nadie llegó a fusionar */
+    if (dev->stage)
+    {
+        for_each_possible_cpu(cpu)
+        {
+            struct aesd_stage *stage = per_cpu_ptr(dev->stage, cpu);
+            struct aesd_staged_entry *staged, *tmp;
+
+            list_for_each_entry_safe(staged, tmp, &stage->list, node)
+            {
+                aesd_cmd_free(staged->entry.buffptr);
+                kfree(staged);
+            }
+        }
+        free_percpu(dev->stage);
+        dev->stage = NULL;
+    }
+
+    /* Liberar entradas del buffer circular si quedaron asignadas */
+    if (dev->buffer.arena)
+    {
+        vfree(dev->buffer.arena);
+        dev->buffer.arena = NULL;
+    }
+    else
+    {
+        AESD_CIRCULAR_BUFFER_FOREACH(entry, &dev->buffer, i)
+        {
+            aesd_cmd_free(entry->buffptr);
+            entry->buffptr = NULL;
+            entry->size = 0;
+        }
+    }
+    if (dev->buffer.entry != dev->buffer.default_entry)
+        kvfree(dev->buffer.entry);
+
+    /* El módulo no puede descargarse con mapeos activos: ya no queda ninguno */
+    vfree(dev->mmap_area);
+    dev->mmap_area = NULL;
+
+    free_percpu(dev->stats);
+    dev->stats = NULL;
+}
+
 int aesd_init_module(void)
 {
     dev_t dev = 0;
+    unsigned int i;
+    unsigned int j;
     int result;
-    result = alloc_chrdev_region(&dev, aesd_minor, 1, "aesdchar");
+
+    if (aesd_nr_devs == 0 || aesd_nr_devs > AESD_MAX_DEVS)
+    {
+        printk(KERN_ERR "aesdchar: invalid aesd_nr_devs %u\n", aesd_nr_devs);
+        return -EINVAL;
+    }
+
+    result = alloc_chrdev_region(&dev, aesd_minor, aesd_nr_devs, "aesdchar");
     aesd_major = MAJOR(dev);
     if (result < 0)
     {
         printk(KERN_WARNING "Can't get major %d\n", aesd_major);
         return result;
     }
-    memset(&aesd_device, 0, sizeof(struct aesd_dev));
-
-    /**
-     * TODO: initialize the AESD specific portion of the device
-     */
-    aesd_circular_buffer_init(&aesd_device.buffer);
-
-    /* Inicializa los buffers pendientes */
-    aesd_device.pending_buf = NULL;
-    aesd_device.pending_size = 0;
 
-    result = aesd_setup_cdev(&aesd_device);
+    aesd_devices = kcalloc(aesd_nr_devs, sizeof(*aesd_devices), GFP_KERNEL);
+    if (!aesd_devices)
+    {
+        result = -ENOMEM;
+        goto fail_region;
+    }
+    aesd_debugfs_root = debugfs_create_dir("aesdchar", NULL);
 
-    if (result)
+    for (i = 0; i < aesd_nr_devs; i++)
     {
-        unregister_chrdev_region(dev, 1);
+        result = aesd_dev_init(&aesd_devices[i]);
+        if (result)
+            goto fail_devices;
+
+        result = aesd_setup_cdev(&aesd_devices[i], i);
+        if (result)
+        {
+            aesd_dev_cleanup(&aesd_devices[i]);
+            goto fail_devices;
+        }
+        aesd_debugfs_add(&aesd_devices[i], i);
     }
+
+    return 0;
+
+fail_devices:
+    debugfs_remove_recursive(aesd_debugfs_root);
+    aesd_debugfs_root = NULL;
+    // Los dispositivos 0..i-1 ya están registrados
+    for (j = 0; j < i; j++)
+        cdev_del(&aesd_devices[j].cdev);
+    srcu_barrier(&aesd_srcu);
+    for (j = 0; j < i; j++)
+        aesd_dev_cleanup(&aesd_devices[j]);
+    kfree(aesd_devices);
+    aesd_devices = NULL;
+fail_region:
+    unregister_chrdev_region(dev, aesd_nr_devs);
     return result;
 }
 
 void aesd_cleanup_module(void)
 {
     dev_t devno = MKDEV(aesd_major, aesd_minor);
-    uint8_t i;
+    unsigned int i;
 
-    cdev_del(&aesd_device.cdev);
+    // Primero debugfs: aesd_stats_show no debe ver dispositivos ya liberados
+    debugfs_remove_recursive(aesd_debugfs_root);
+    aesd_debugfs_root = NULL;
 
-    /* Liberar cualquier pendencia */
-    if (aesd_device.pending_buf)
-    {
-        kfree(aesd_device.pending_buf);
-        aesd_device.pending_buf = NULL;
-        aesd_device.pending_size = 0;
-    }
+    for (i = 0; i < aesd_nr_devs; i++)
+        cdev_del(&aesd_devices[i].cdev);
 
-    /* Liberar entradas del buffer circular si quedaron asignadas */
-    for (i = 0; i < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; i++)
-    {
-        kfree(aesd_device.buffer.entry[i].buffptr);
-        aesd_device.buffer.entry[i].buffptr = NULL;
-        aesd_device.buffer.entry[i].size = 0;
-    }
+    /* Espera a que terminen las liberaciones diferidas pendientes */
+    srcu_barrier(&aesd_srcu);
+
+    for (i = 0; i < aesd_nr_devs; i++)
+        aesd_dev_cleanup(&aesd_devices[i]);
+    kfree(aesd_devices);
+    aesd_devices = NULL;
 
-    unregister_chrdev_region(devno, 1);
+    unregister_chrdev_region(devno, aesd_nr_devs);
 }
 
 module_init(aesd_init_module);
@@ -0,0 +1,359 @@
+/**
+ * @file circular-buffer-bench.c
+ * @brief Microbenchmarks for aesd-circular-buffer.c
+ *
+ * Measures add_entry throughput (pointer entries and arena copies), fpos lookup
+ * latency at several fill levels, capacities and entry sizes, and one producer
+ * against several concurrent readers.  Each result is printed as one JSON object
+ * per line so runs can be compared with a script.
+ *
+ * Build the variant under test with the same flags as the code that uses it:
+ * the aesd-circular-buffer-bench target uses the mutex build and
+ * aesd-circular-buffer-bench-lockfree defines AESD_CIRCULAR_BUFFER_LOCKFREE.
+ *
+ * Usage: aesd-circular-buffer-bench [-q] [-t milliseconds]
+ *   -q  quick run (fewer iterations, for smoke testing)
+ *   -t  duration of each contended run, 200 ms by default
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include "aesd-circular-buffer.h"
+
+#ifdef AESD_CIRCULAR_BUFFER_LOCKFREE
+#define VARIANT "lockfree"
+#else
+#define VARIANT "mutex"
+#endif
+
+#define MAX_READERS 8
+
+static const size_t capacities[] = {10, 128, 4096, 65536};
+static const size_t entry_sizes[] = {16, 256, 4096};
+static const unsigned int fill_percents[] = {10, 50, 100};
+static const unsigned int reader_counts[] = {1, 2, 4, 8};
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+static bool quick = false;
+static unsigned int contended_ms = 200;
+
+// Evita que el compilador elimine el trabajo medido
+static volatile size_t sink;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+// Generador pseudoaleatorio por hilo, sin estado compartido
+static inline uint64_t xorshift64(uint64_t *state)
+{
+    uint64_t x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *state = x;
+    return x;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+/**
+ * Inicializa @param buffer con @param capacity entradas.
+ * @return el almacenamiento reservado (liberar con free), NULL si es el embebido
+ */
+static struct aesd_buffer_entry *setup_buffer(struct aesd_circular_buffer *buffer, size_t capacity)
+{
+    struct aesd_buffer_entry *entries;
+    struct aesd_buffer_entry *old_entries;
+
+    aesd_circular_buffer_init(buffer);
+    if (capacity == AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED)
+        return NULL;
+
+    entries = calloc(capacity, sizeof(*entries));
+    if (!entries || !aesd_circular_buffer_resize(buffer, entries, capacity, &old_entries))
+    {
+        fprintf(stderr, "cannot set capacity %zu\n", capacity);
+        exit(1);
+    }
+    return entries;
+}
+
+static void bench_add_entry(const char *data)
+{
+    size_t c, s;
+
+    for (c = 0; c < ARRAY_SIZE(capacities); c++)
+    {
+        for (s = 0; s < ARRAY_SIZE(entry_sizes); s++)
+        {
+            struct aesd_circular_buffer buffer;
+            struct aesd_buffer_entry *entries = setup_buffer(&buffer, capacities[c]);
+            struct aesd_buffer_entry entry = {.buffptr = data, .size = entry_sizes[s]};
+            size_t ops = quick ? 100000 : 2000000;
+            uint64_t start;
+            uint64_t elapsed;
+            size_t i;
+
+            start = now_ns();
+            for (i = 0; i < ops; i++)
+                sink += (size_t)aesd_circular_buffer_add_entry(&buffer, &entry);
+            elapsed = now_ns() - start;
+
+            printf("{\"bench\":\"add_entry\",\"variant\":\"%s\",\"capacity\":%zu,\"entry_size\":%zu,"
+                   "\"ops\":%zu,\"ns_per_op\":%.2f,\"ops_per_sec\":%.0f}\n",
+                   VARIANT, capacities[c], entry_sizes[s], ops, (double)elapsed / ops, ops * 1e9 / elapsed);
+            free(entries);
+        }
+    }
+}
+
+static void bench_add_entry_arena(const char *data)
+{
+    size_t c, s;
+
+    for (c = 0; c < ARRAY_SIZE(capacities); c++)
+    {
+        for (s = 0; s < ARRAY_SIZE(entry_sizes); s++)
+        {
+            struct aesd_circular_buffer buffer;
+            struct aesd_buffer_entry *entries = setup_buffer(&buffer, capacities[c]);
+            // Arena algo mayor que capacity entradas: se ejercitan los saltos al principio
+            size_t arena_size = capacities[c] * entry_sizes[s] + entry_sizes[s] / 2;
+            char *arena = malloc(arena_size);
+            size_t ops = quick ? 50000 : 1000000;
+            size_t evicted = 0;
+            uint64_t start;
+            uint64_t elapsed;
+            size_t i;
+
+            if (!arena || !aesd_circular_buffer_set_arena(&buffer, arena, arena_size))
+            {
+                fprintf(stderr, "cannot set up arena of %zu bytes\n", arena_size);
+                exit(1);
+            }
+
+            start = now_ns();
+            for (i = 0; i < ops; i++)
+            {
+                aesd_circular_buffer_add_entry_arena(&buffer, data, entry_sizes[s], &evicted);
+                sink += evicted;
+            }
+            elapsed = now_ns() - start;
+
+            printf("{\"bench\":\"add_entry_arena\",\"variant\":\"%s\",\"capacity\":%zu,\"entry_size\":%zu,"
+                   "\"ops\":%zu,\"ns_per_op\":%.2f,\"mb_per_sec\":%.1f}\n",
+                   VARIANT, capacities[c], entry_sizes[s], ops, (double)elapsed / ops,
+                   (double)ops * entry_sizes[s] * 1e3 / elapsed);
+            free(arena);
+            free(entries);
+        }
+    }
+}
+
+static void bench_lookup(const char *data)
+{
+    // Las búsquedas se miden en lotes: clock_gettime por búsqueda pesaría más que la búsqueda
+    const size_t batch = 64;
+    size_t c, s, f;
+
+    for (c = 0; c < ARRAY_SIZE(capacities); c++)
+    {
+        for (s = 0; s < ARRAY_SIZE(entry_sizes); s++)
+        {
+            for (f = 0; f < ARRAY_SIZE(fill_percents); f++)
+            {
+                struct aesd_circular_buffer buffer;
+                struct aesd_buffer_entry *entries = setup_buffer(&buffer, capacities[c]);
+                struct aesd_buffer_entry entry = {.buffptr = data, .size = entry_sizes[s]};
+                size_t fill = capacities[c] * fill_percents[f] / 100;
+                size_t batches = quick ? 2000 : 50000;
+                uint64_t *samples = malloc(batches * sizeof(*samples));
+                uint64_t rng = 0x9e3779b97f4a7c15ull;
+                uint64_t total = 0;
+                size_t total_bytes;
+                size_t i, j;
+
+                if (!samples)
+                    exit(1);
+                if (fill == 0)
+                    fill = 1;
+                for (i = 0; i < fill; i++)
+                    aesd_circular_buffer_add_entry(&buffer, &entry);
+                total_bytes = aesd_circular_buffer_size(&buffer);
+
+                for (i = 0; i < batches; i++)
+                {
+                    uint64_t start = now_ns();
+
+                    for (j = 0; j < batch; j++)
+                    {
+                        size_t entry_offset_byte;
+
+                        sink += (size_t)aesd_circular_buffer_find_entry_offset_for_fpos(
+                            &buffer, xorshift64(&rng) % total_bytes, &entry_offset_byte);
+                    }
+                    samples[i] = now_ns() - start;
+                    total += samples[i];
+                }
+                qsort(samples, batches, sizeof(*samples), compare_u64);
+
+                printf("{\"bench\":\"find_entry_offset_for_fpos\",\"variant\":\"%s\",\"capacity\":%zu,"
+                       "\"entry_size\":%zu,\"fill_percent\":%u,\"entries\":%zu,\"lookups\":%zu,"
+                       "\"ns_per_op\":%.2f,\"p50_ns\":%.2f,\"p99_ns\":%.2f}\n",
+                       VARIANT, capacities[c], entry_sizes[s], fill_percents[f], fill, batches * batch,
+                       (double)total / (batches * batch), (double)samples[batches / 2] / batch,
+                       (double)samples[batches * 99 / 100] / batch);
+                free(samples);
+                free(entries);
+            }
+        }
+    }
+}
+
+struct contended_state
+{
+    struct aesd_circular_buffer buffer;
+    volatile bool stop;
+    size_t reader_ops[MAX_READERS];
+    size_t reader_hits[MAX_READERS];
+};
+
+struct reader_arg
+{
+    struct contended_state *state;
+    unsigned int index;
+};
+
+static void *contended_reader(void *arg)
+{
+    struct reader_arg *reader = arg;
+    struct contended_state *state = reader->state;
+    uint64_t rng = 0x2545f4914f6cdd1dull + reader->index;
+    size_t ops = 0;
+    size_t hits = 0;
+
+    while (!state->stop)
+    {
+        size_t size = aesd_circular_buffer_size(&state->buffer);
+        struct aesd_buffer_entry entry;
+        size_t entry_offset_byte;
+
+        if (size && aesd_circular_buffer_snapshot_entry(&state->buffer, xorshift64(&rng) % size, &entry,
+                                                        &entry_offset_byte))
+            hits++;
+        ops++;
+    }
+    state->reader_ops[reader->index] = ops;
+    state->reader_hits[reader->index] = hits;
+    return NULL;
+}
+
+static void bench_contended(const char *data)
+{
+    const size_t capacity = 4096;
+    size_t r;
+
+    for (r = 0; r < ARRAY_SIZE(reader_counts); r++)
+    {
+        struct contended_state *state = calloc(1, sizeof(*state));
+        struct aesd_buffer_entry *entries;
+        struct aesd_buffer_entry entry = {.buffptr = data, .size = 64};
+        struct reader_arg args[MAX_READERS];
+        pthread_t threads[MAX_READERS];
+        unsigned int readers = reader_counts[r];
+        size_t producer_ops = 0;
+        size_t reader_total = 0;
+        uint64_t start;
+        uint64_t deadline;
+        uint64_t elapsed;
+        unsigned int i;
+
+        if (!state)
+            exit(1);
+        entries = setup_buffer(&state->buffer, capacity);
+        for (i = 0; i < capacity; i++)
+            aesd_circular_buffer_add_entry(&state->buffer, &entry);
+
+        for (i = 0; i < readers; i++)
+        {
+            args[i].state = state;
+            args[i].index = i;
+            pthread_create(&threads[i], NULL, contended_reader, &args[i]);
+        }
+
+        // El hilo principal es el único productor
+        start = now_ns();
+        deadline = start + (uint64_t)contended_ms * 1000000ull;
+        do
+        {
+            for (i = 0; i < 256; i++)
+                aesd_circular_buffer_add_entry(&state->buffer, &entry);
+            producer_ops += 256;
+        } while (now_ns() < deadline);
+        state->stop = true;
+        elapsed = now_ns() - start;
+
+        for (i = 0; i < readers; i++)
+        {
+            pthread_join(threads[i], NULL);
+            reader_total += state->reader_ops[i];
+        }
+
+        printf("{\"bench\":\"contended\",\"variant\":\"%s\",\"capacity\":%zu,\"readers\":%u,"
+               "\"duration_ms\":%.1f,\"producer_ops_per_sec\":%.0f,\"reader_ops_per_sec\":%.0f}\n",
+               VARIANT, capacity, readers, elapsed / 1e6, producer_ops * 1e9 / elapsed,
+               reader_total * 1e9 / elapsed);
+        free(entries);
+        free(state);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    static char data[4096];
+    int opt;
+
+    while ((opt = getopt(argc, argv, "qt:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'q':
+            quick = true;
+            break;
+        case 't':
+            contended_ms = (unsigned int)strtoul(optarg, NULL, 10);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-q] [-t milliseconds]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (quick && contended_ms > 50)
+        contended_ms = 50;
+
+    memset(data, 'x', sizeof(data));
+
+    bench_add_entry(data);
+    bench_add_entry_arena(data);
+    bench_lookup(data);
+    bench_contended(data);
+    return 0;
+}
@@ -0,0 +1,364 @@
+/**
+ * @file aesdsocket-bench.c
+ * @brief Generador de carga y medidor de latencia para aesdsocket
+ *
+ * Abre varias conexiones simultáneas al puerto 9000 y por cada una envía
+ * uno o varios paquetes seguidos (-m) terminados en '\n', opcionalmente
+ * partidos en varios send() o sustituidos por comandos AESDCHAR_IOCSEEKTO,
+ * cierra el sentido de escritura y lee las respuestas hasta que el servidor
+ * cierra. Cada petición usa una conexión nueva. Al terminar imprime una
+ * línea JSON con el rendimiento y las latencias p50/p99/p999 por petición
+ * (desde connect hasta el cierre del servidor).
+ *
+ * Para medir sin el módulo aesdchar cargado, arrancar el servidor sobre un
+ * fichero normal:
+ *     ./aesdsocket -e -f /tmp/aesdsocketdata &
+ *     ./aesdsocket-bench -c 16 -n 200 -s 128
+ * Con un fichero normal la respuesta crece con cada paquete (se devuelve el
+ * fichero entero) y los AESDCHAR_IOCSEEKTO fallan en el servidor; conviene
+ * borrar el fichero entre ejecuciones para poder compararlas.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#define PORT 9000
+#define RECV_BUFFER_SIZE (64 * 1024)
+// Tiempo máximo esperando al servidor antes de contar la petición como error
+#define IO_TIMEOUT_SEC 10
+// Longitud máxima de una línea AESDCHAR_IOCSEEKTO:X,Y
+#define SEEKTO_MAX 64
+
+typedef struct bench_config
+{
+    struct sockaddr_in server_addr;
+    unsigned int connections; // hilos, cada uno con una conexión abierta a la vez
+    unsigned int packets;     // peticiones (conexiones) por hilo
+    unsigned int pipeline;    // paquetes enviados seguidos en cada conexión
+    size_t packet_size;       // bytes por paquete, incluido el '\n'
+    unsigned int split;       // trozos en los que se parte cada paquete
+    unsigned int split_delay_us;
+    unsigned int seekto_percent; // porcentaje de paquetes AESDCHAR_IOCSEEKTO
+} bench_config_t;
+
+typedef struct worker
+{
+    const bench_config_t *config;
+    pthread_t thread_id;
+    unsigned int index;
+    uint64_t *latencies; // ns por petición completada
+    size_t completed;
+    size_t errors;
+    uint64_t bytes_sent;
+    uint64_t bytes_received;
+} worker_t;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+// Envía @param len bytes completos por el socket
+static int send_all(int fd, const char *buf, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t sent = send(fd, buf, len, MSG_NOSIGNAL);
+        if (sent < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += sent;
+        len -= (size_t)sent;
+    }
+    return 0;
+}
+
+/**
+ * Hace una petición completa: connect, envío de @param request (en
+ * @param pieces trozos), cierre del sentido de escritura y lectura hasta que
+ * el servidor cierra.
+ * @return 0 si la petición terminó bien, -1 en caso de error
+ */
+static int run_request(worker_t *worker, const char *request, size_t len, unsigned int pieces, char *recv_buf)
+{
+    const bench_config_t *config = worker->config;
+    struct timeval timeout = {.tv_sec = IO_TIMEOUT_SEC};
+    int one = 1;
+    int ret = -1;
+    int fd;
+
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    // Sin Nagle cada trozo sale en su propio segmento
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    if (connect(fd, (struct sockaddr *)&config->server_addr, sizeof(config->server_addr)) < 0)
+        goto out;
+
+    size_t chunk = (len + pieces - 1) / pieces;
+    size_t offset = 0;
+    while (offset < len)
+    {
+        size_t n = len - offset < chunk ? len - offset : chunk;
+
+        if (send_all(fd, request + offset, n) < 0)
+            goto out;
+        worker->bytes_sent += n;
+        offset += n;
+        if (offset < len && config->split_delay_us)
+            usleep(config->split_delay_us);
+    }
+    // El servidor mantiene la conexión abierta hasta ver EOF
+    if (shutdown(fd, SHUT_WR) < 0)
+        goto out;
+
+    for (;;)
+    {
+        ssize_t received = recv(fd, recv_buf, RECV_BUFFER_SIZE, 0);
+        if (received < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            goto out;
+        }
+        if (received == 0)
+            break;
+        worker->bytes_received += (uint64_t)received;
+    }
+    ret = 0;
+
+out:
+    close(fd);
+    return ret;
+}
+
+static void *worker_thread(void *arg)
+{
+    worker_t *worker = arg;
+    const bench_config_t *config = worker->config;
+    char *packet = malloc(config->packet_size);
+    char *recv_buf = malloc(RECV_BUFFER_SIZE);
+    // Cada paquete de la petición ocupa como mucho packet_size o SEEKTO_MAX bytes
+    size_t slot = config->packet_size > SEEKTO_MAX ? config->packet_size : SEEKTO_MAX;
+    char *request = malloc(slot * config->pipeline);
+    unsigned int i;
+
+    if (!packet || !recv_buf || !request)
+    {
+        worker->errors = config->packets;
+        goto out;
+    }
+
+    // Contenido reconocible por hilo: "<hilo>:" seguido de letras y '\n' al final
+    int prefix = snprintf(packet, config->packet_size, "%u:", worker->index);
+    for (size_t j = (size_t)prefix; j < config->packet_size; j++)
+        packet[j] = (char)('a' + j % 26);
+    packet[config->packet_size - 1] = '\n';
+
+    for (i = 0; i < config->packets; i++)
+    {
+        size_t len = 0;
+
+        for (unsigned int j = 0; j < config->pipeline; j++)
+        {
+            unsigned int k = i * config->pipeline + j;
+
+            // Reparto determinista: seekto_percent de cada 100 paquetes seguidos, desfasado por hilo
+            if (config->seekto_percent && (k + worker->index) % 100 < config->seekto_percent)
+            {
+                len += (size_t)snprintf(request + len, SEEKTO_MAX, "AESDCHAR_IOCSEEKTO:0,%u\n", k % 4);
+                continue;
+            }
+            memcpy(request + len, packet, config->packet_size);
+            len += config->packet_size;
+        }
+
+        uint64_t start = now_ns();
+        if (run_request(worker, request, len, config->split * config->pipeline, recv_buf) < 0)
+        {
+            worker->errors++;
+            continue;
+        }
+        worker->latencies[worker->completed++] = now_ns() - start;
+    }
+
+out:
+    free(request);
+    free(packet);
+    free(recv_buf);
+    return NULL;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-H host] [-p port] [-c connections] [-n requests] [-m packets_per_request]\n"
+            "          [-s size] [-x split] [-w split_delay_us] [-k seekto_percent]\n",
+            prog);
+}
+
+int main(int argc, char *argv[])
+{
+    bench_config_t config = {
+        .connections = 8,
+        .packets = 100,
+        .pipeline = 1,
+        .packet_size = 64,
+        .split = 1,
+        .split_delay_us = 0,
+        .seekto_percent = 0};
+    const char *host = "127.0.0.1";
+    unsigned int port = PORT;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "H:p:c:n:m:s:x:w:k:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'H':
+            host = optarg;
+            break;
+        case 'p':
+            port = (unsigned int)strtoul(optarg, NULL, 10);
+            break;
+        case 'c':
+            config.connections = (unsigned int)strtoul(optarg, NULL, 10);
+            break;
+        case 'n':
+            config.packets = (unsigned int)strtoul(optarg, NULL, 10);
+            break;
+        case 'm':
+            config.pipeline = (unsigned int)strtoul(optarg, NULL, 10);
+            break;
+        case 's':
+            config.packet_size = strtoul(optarg, NULL, 10);
+            break;
+        case 'x':
+            config.split = (unsigned int)strtoul(optarg, NULL, 10);
+            break;
+        case 'w':
+            config.split_delay_us = (unsigned int)strtoul(optarg, NULL, 10);
+            break;
+        case 'k':
+            config.seekto_percent = (unsigned int)strtoul(optarg, NULL, 10);
+            break;
+        default:
+            usage(argv[0]);
+            return -1;
+        }
+    }
+
+    // El paquete necesita sitio para el prefijo del hilo y el '\n'
+    if (config.connections == 0 || config.packets == 0 || config.pipeline == 0 || config.packet_size < 16 ||
+        config.split == 0 ||
+        config.seekto_percent > 100 || port == 0 || port > 65535)
+    {
+        usage(argv[0]);
+        return -1;
+    }
+
+    config.server_addr.sin_family = AF_INET;
+    config.server_addr.sin_port = htons((uint16_t)port);
+    if (inet_pton(AF_INET, host, &config.server_addr.sin_addr) != 1)
+    {
+        fprintf(stderr, "Invalid IPv4 address: %s\n", host);
+        return -1;
+    }
+
+    worker_t *workers = calloc(config.connections, sizeof(*workers));
+    if (!workers)
+        return -1;
+
+    unsigned int i;
+    for (i = 0; i < config.connections; i++)
+    {
+        workers[i].config = &config;
+        workers[i].index = i;
+        workers[i].latencies = malloc(config.packets * sizeof(uint64_t));
+        if (!workers[i].latencies)
+            return -1;
+    }
+
+    uint64_t start = now_ns();
+    for (i = 0; i < config.connections; i++)
+    {
+        if (pthread_create(&workers[i].thread_id, NULL, worker_thread, &workers[i]) != 0)
+        {
+            fprintf(stderr, "pthread_create failed\n");
+            return -1;
+        }
+    }
+
+    size_t completed = 0;
+    size_t errors = 0;
+    uint64_t bytes_sent = 0;
+    uint64_t bytes_received = 0;
+    for (i = 0; i < config.connections; i++)
+    {
+        pthread_join(workers[i].thread_id, NULL);
+        completed += workers[i].completed;
+        errors += workers[i].errors;
+        bytes_sent += workers[i].bytes_sent;
+        bytes_received += workers[i].bytes_received;
+    }
+    uint64_t elapsed = now_ns() - start;
+
+    // Unir las latencias de todos los hilos para los percentiles
+    uint64_t *latencies = malloc((completed ? completed : 1) * sizeof(uint64_t));
+    size_t n = 0;
+    if (!latencies)
+        return -1;
+    for (i = 0; i < config.connections; i++)
+    {
+        memcpy(latencies + n, workers[i].latencies, workers[i].completed * sizeof(uint64_t));
+        n += workers[i].completed;
+        free(workers[i].latencies);
+    }
+    qsort(latencies, completed, sizeof(uint64_t), compare_u64);
+
+#define PERCENTILE_US(p) (completed ? latencies[(size_t)((completed - 1) * (p))] / 1e3 : 0.0)
+    printf("{\"bench\":\"aesdsocket\",\"connections\":%u,\"packets\":%u,\"pipeline\":%u,\"packet_size\":%zu,"
+           "\"split\":%u,\"seekto_percent\":%u,\"completed\":%zu,\"errors\":%zu,\"duration_s\":%.3f,"
+           "\"requests_per_sec\":%.1f,\"packets_per_sec\":%.1f,\"sent_mb_per_sec\":%.3f,\"received_mb_per_sec\":%.3f,"
+           "\"p50_us\":%.1f,\"p99_us\":%.1f,\"p999_us\":%.1f,\"max_us\":%.1f}\n",
+           config.connections, config.packets, config.pipeline, config.packet_size, config.split,
+           config.seekto_percent, completed, errors, elapsed / 1e9, completed * 1e9 / elapsed,
+           (double)completed * config.pipeline * 1e9 / elapsed, bytes_sent * 1e3 / elapsed,
+           bytes_received * 1e3 / elapsed, PERCENTILE_US(0.50), PERCENTILE_US(0.99), PERCENTILE_US(0.999),
+           PERCENTILE_US(1.0));
+#undef PERCENTILE_US
+
+    free(latencies);
+    free(workers);
+    return errors ? 1 : 0;
+}
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
@@ -13,14 +14,170 @@
 #include <pthread.h>
 #include <time.h>
 #include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/timerfd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <limits.h>
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+// Cabeceras anteriores a 5.7 no declaran todas las operaciones que usa el backend -u
+#if defined(IORING_FEAT_FAST_POLL) && defined(__NR_io_uring_setup)
+#define HAVE_IO_URING
+#endif
+#endif
+#endif
 #include "../aesd-char-driver/aesd_ioctl.h"
+#include "../aesd-char-driver/aesd-circular-buffer.h"
 
 #define PORT 9000
 #define BACKLOG 1
+// Fichero de datos por defecto; -f lo cambia (p.ej. un fichero normal sin el módulo cargado)
 #define DATAFILE "/dev/aesdchar"
 #define BUFFER_SIZE 1024
+// Modo epoll (-e): conexiones aceptadas y aún no terminadas como máximo
+#define MAX_PENDING_CONNECTIONS 1024
+#define MAX_EPOLL_EVENTS 64
+// Descriptores de lectura abiertos que se guardan para reutilizar
+#define READ_FD_CACHE_SIZE 16
+// Descriptores de escritura por conexión que se guardan para reutilizar
+#define WRITE_FD_CACHE_SIZE 16
+// Intervalo por defecto entre marcas de tiempo (-t)
+#define TIMESTAMP_INTERVAL_SEC 10
+// Bytes máximos por llamada a sendfile
+#define SENDFILE_CHUNK (1024 * 1024)
+// Almacén en proceso (-s mmap): fichero por defecto y retención por defecto (-n, -z)
+#define STOREFILE "/var/tmp/aesdsocketdata"
+#define STORE_MAX_ENTRIES AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED
+#define STORE_MAX_BYTES (1024 * 1024)
 
-// Estructura para pasar datos a los hilos
+static volatile sig_atomic_t exit_requested = 0;
+static volatile sig_atomic_t reopen_requested = 0;
+static const char *datafile_path = DATAFILE;
+
+/*
+ * Descriptores persistentes de DATAFILE.
+ *
+ * Se mantiene un descriptor de escritura compartido (temporizador) y cachés
+ * de descriptores de escritura y de lectura para las conexiones, en lugar de
+ * abrir y cerrar el fichero en cada recv. Cada conexión escribe su paquete
+ * por un descriptor propio: el driver acumula el comando a medias por
+ * descriptor, así que los paquetes de conexiones simultáneas no se mezclan
+ * aunque lleguen en varios recv.
+ * content_lock separa escritores y lectores del contenido: cada write() toma
+ * el lock de escritura sólo mientras dura la llamada y cada eco el de lectura
+ * mientras fija su instantánea, así los ecos no se esperan entre sí y el
+ * envío al cliente queda fuera de cualquier lock.
+ * Política de reapertura:
+ *  - si una operación falla con un error que indica que el dispositivo ya
+ *    no es válido (ENODEV, ENXIO, EIO, EBADF, ESTALE) se cierra el
+ *    descriptor y se reabre una vez;
+ *  - SIGHUP cierra todos los descriptores guardados (p.ej. para poder
+ *    descargar y recargar el módulo aesdchar); se reabren al siguiente uso.
+ */
+// Con glibc se da preferencia a los escritores: muchos ecos seguidos no los bloquean
+#ifdef PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP
+#define DATAFILE_CONTENT_LOCK_INIT PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP
+#else
+#define DATAFILE_CONTENT_LOCK_INIT PTHREAD_RWLOCK_INITIALIZER
+#endif
+
+// Dónde se guardan los paquetes; se elige al arrancar con -s
+typedef enum datafile_store
+{
+    DATAFILE_STORE_DEVICE, // DATAFILE por descriptores: el driver o un fichero normal
+    DATAFILE_STORE_MMAP,   // memstore, en el propio proceso
+} datafile_store_t;
+
+typedef struct datafile
+{
+    datafile_store_t store;
+    pthread_mutex_t lock; // protege las cachés de descriptores
+    pthread_rwlock_t content_lock;
+    int write_fd;
+    int write_fds[WRITE_FD_CACHE_SIZE];
+    size_t num_write_fds;
+    int read_fds[READ_FD_CACHE_SIZE];
+    size_t num_read_fds;
+    unsigned int generation; // cambia cada vez que se descartan los descriptores
+    bool sendfile_unsupported; // DATAFILE no admite sendfile: usar copia
+} datafile_t;
+
+static datafile_t datafile = {
+    .store = DATAFILE_STORE_DEVICE,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .content_lock = DATAFILE_CONTENT_LOCK_INIT,
+    .write_fd = -1,
+    .num_write_fds = 0,
+    .num_read_fds = 0,
+    .generation = 0,
+    .sendfile_unsupported = false};
+
+typedef struct datafile_reader
+{
+    int fd;
+    unsigned int generation;
+} datafile_reader_t;
+
+typedef struct datafile_writer
+{
+    int fd; // -1 hasta la primera escritura
+    unsigned int generation;
+    bool written; // ya se escribió algo por fd
+    bool partial; // lo último escrito no terminaba en '\n'
+    char *pending; // memstore: comando a medias, hasta su '\n'
+    size_t pending_len;
+    size_t pending_size;
+} datafile_writer_t;
+
+#define DATAFILE_WRITER_INIT                                                                           \
+    {.fd = -1, .generation = 0, .written = false, .partial = false, .pending = NULL, .pending_len = 0, \
+     .pending_size = 0}
+
+#define SEEKTO_PREFIX "AESDCHAR_IOCSEEKTO:"
+#define SEEKTO_PREFIX_LEN (sizeof(SEEKTO_PREFIX) - 1)
+// Longitud máxima de una línea AESDCHAR_IOCSEEKTO:X,Y, '\0' incluido
+#define FRAMER_HOLD_SIZE 64
+
+typedef enum frame_kind
+{
+    FRAME_NONE,
+    FRAME_DATA,
+    FRAME_PACKET,
+    FRAME_SEEKTO,
+} frame_kind_t;
+
+/*
+ * Separa el flujo de una conexión en paquetes terminados en '\n' y comandos
+ * AESDCHAR_IOCSEEKTO:X,Y, que pueden llegar partidos en varios recv o varios
+ * en el mismo recv. Ver framer_next().
+ */
+typedef struct framer
+{
+    const char *in; // resto del trozo recibido sin procesar
+    size_t in_len;
+    bool in_data; // la línea actual ya se sabe que es un paquete normal
+    char hold[FRAMER_HOLD_SIZE];
+    size_t hold_len;
+    uint32_t write_cmd;
+    uint32_t write_cmd_offset;
+} framer_t;
+
+// A qué espera una conexión atendida por connection_process()
+typedef enum connection_state
+{
+    CONNECTION_CLOSED,
+    CONNECTION_WAIT_READ,  // el cliente no ha mandado más datos
+    CONNECTION_WAIT_WRITE, // el cliente no ha leído todo el eco
+} connection_state_t;
+
+// Estado de una conexión de cliente (modo hilos y modo epoll)
 typedef struct thread_data
 {
     int client_fd;
@@ -28,10 +185,584 @@ typedef struct thread_data
     pthread_t thread_id;
     bool completed;
     struct thread_data *next;
+    // Modo -e: lista de conexiones vivas del pool, para cerrarlas al terminar
+    struct thread_data *live_prev;
+    struct thread_data *live_next;
+    datafile_writer_t writer; // se mantiene toda la conexión
+    bool write_failed;
+    framer_t framer;
+    char *snapshot; // copia del dispositivo para el eco, se libera al terminarlo
+    size_t snapshot_size;
+    // Resto del último eco (modo -e: el socket no bloquea y el cliente puede leer despacio)
+    const char *out_buf; // en memoria, dentro de snapshot
+    size_t out_len;
+    datafile_reader_t out_reader; // fd >= 0: rango [out_pos, out_end) de un fichero normal
+    off_t out_pos;
+    off_t out_end;
+    char recv_buf[BUFFER_SIZE];
+    char send_buf[BUFFER_SIZE];
 } thread_data_t;
 
-static volatile sig_atomic_t exit_requested = 0;
-pthread_mutex_t file_mutex = PTHREAD_MUTEX_INITIALIZER;
+static bool datafile_error_is_stale(int err)
+{
+    return err == ENODEV || err == ENXIO || err == EIO || err == EBADF || err == ESTALE;
+}
+
+// Cierra todos los descriptores guardados. Llamar con datafile.lock tomado.
+static void datafile_drop_locked(void)
+{
+    if (datafile.write_fd >= 0)
+    {
+        close(datafile.write_fd);
+        datafile.write_fd = -1;
+    }
+    while (datafile.num_write_fds > 0)
+        close(datafile.write_fds[--datafile.num_write_fds]);
+    while (datafile.num_read_fds > 0)
+        close(datafile.read_fds[--datafile.num_read_fds]);
+    datafile.generation++;
+    // El fichero reabierto puede ser otro driver: volver a probar sendfile
+    datafile.sendfile_unsupported = false;
+}
+
+static void datafile_check_reopen_locked(void)
+{
+    if (reopen_requested)
+    {
+        reopen_requested = 0;
+        syslog(LOG_INFO, "Dropping cached descriptors for %s", datafile_path);
+        datafile_drop_locked();
+    }
+}
+
+static void datafile_close_all(void)
+{
+    pthread_mutex_lock(&datafile.lock);
+    datafile_drop_locked();
+    pthread_mutex_unlock(&datafile.lock);
+}
+
+/*
+ * Almacén en espacio de usuario (-s mmap).
+ *
+ * Sustituye al driver en máquinas sin el módulo aesdchar. Los comandos se
+ * guardan uno tras otro en un fichero proyectado con mmap que hace de arena
+ * de aesd-circular-buffer.c: cuando no caben más bytes o más comandos se
+ * descartan los más antiguos, como en el driver, y AESDCHAR_IOCSEEKTO se
+ * resuelve con el índice del buffer circular sin salir del proceso. Cada
+ * escritor acumula su comando a medias hasta el '\n' y lo pierde si se
+ * cierra antes, igual que un descriptor del driver.
+ * El fichero es el propio anillo, no un registro que sólo crece: se vacía al
+ * arrancar y se borra al salir, como DATAFILE, así que el historial no
+ * sobrevive a un reinicio del servidor.
+ * datafile.content_lock protege el contenido: los comandos se añaden con el
+ * lock de escritura y cada eco copia su instantánea con el de lectura.
+ */
+typedef struct memstore
+{
+    struct aesd_circular_buffer buffer;
+    struct aesd_buffer_entry *entries; // NULL mientras se usa default_entry
+    char *arena;                       // fichero de datos proyectado
+    size_t arena_size;
+} memstore_t;
+
+static memstore_t memstore;
+
+/**
+ * Crea (o vacía) DATAFILE con @param max_bytes bytes, lo proyecta y prepara
+ * el índice para @param max_entries comandos.
+ * @return 0 en caso de éxito, -1 en caso de error
+ */
+static int memstore_open(size_t max_entries, size_t max_bytes)
+{
+    struct aesd_buffer_entry *old_entries;
+    int fd = open(datafile_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+    if (fd < 0)
+    {
+        syslog(LOG_ERR, "File open failed: %s", strerror(errno));
+        return -1;
+    }
+    if (ftruncate(fd, (off_t)max_bytes) < 0)
+    {
+        syslog(LOG_ERR, "Failed to size %s: %s", datafile_path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    memstore.arena = mmap(NULL, max_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    // La proyección mantiene el fichero abierto
+    close(fd);
+    if (memstore.arena == MAP_FAILED)
+    {
+        syslog(LOG_ERR, "mmap of %s failed: %s", datafile_path, strerror(errno));
+        memstore.arena = NULL;
+        return -1;
+    }
+    memstore.arena_size = max_bytes;
+
+    aesd_circular_buffer_init(&memstore.buffer);
+    if (max_entries != AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED)
+    {
+        memstore.entries = calloc(max_entries, sizeof(*memstore.entries));
+        if (!memstore.entries ||
+            !aesd_circular_buffer_resize(&memstore.buffer, memstore.entries, max_entries, &old_entries))
+        {
+            syslog(LOG_ERR, "Cannot keep %zu commands", max_entries);
+            free(memstore.entries);
+            memstore.entries = NULL;
+            munmap(memstore.arena, memstore.arena_size);
+            memstore.arena = NULL;
+            return -1;
+        }
+    }
+    aesd_circular_buffer_set_arena(&memstore.buffer, memstore.arena, memstore.arena_size);
+    syslog(LOG_INFO, "Using in-process store %s: %zu commands, %zu bytes", datafile_path, max_entries, max_bytes);
+    return 0;
+}
+
+static void memstore_close(void)
+{
+    if (memstore.arena)
+        munmap(memstore.arena, memstore.arena_size);
+    memstore.arena = NULL;
+    free(memstore.entries);
+    memstore.entries = NULL;
+#ifndef AESD_CIRCULAR_BUFFER_LOCKFREE
+    pthread_mutex_destroy(&memstore.buffer.lock);
+#endif
+}
+
+/**
+ * Añade el comando completo de @param len bytes de @param buf, descartando
+ * los más antiguos si hace falta sitio.
+ * @return 0 en caso de éxito, -1 si no cabe en el arena (errno = EFBIG)
+ */
+static int memstore_add(const char *buf, size_t len)
+{
+    pthread_rwlock_wrlock(&datafile.content_lock);
+    bool added = aesd_circular_buffer_add_entry_arena(&memstore.buffer, buf, len, NULL);
+    pthread_rwlock_unlock(&datafile.content_lock);
+
+    if (!added)
+    {
+        errno = EFBIG;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Versión de datafile_writer_write() para memstore: los bytes se acumulan en
+ * @param writer hasta que lo escrito termina en '\n' y entonces pasan a ser
+ * un comando. Un comando completo sin nada a medias va directo al arena.
+ * @return 0 en caso de éxito, -1 en caso de error (errno indica la causa)
+ */
+static int memstore_writer_write(datafile_writer_t *writer, const char *buf, size_t len)
+{
+    bool complete = buf[len - 1] == '\n';
+    int ret = 0;
+
+    if (writer->pending_len == 0 && complete)
+    {
+        ret = memstore_add(buf, len);
+    }
+    else if (len > memstore.arena_size - writer->pending_len)
+    {
+        // No cabría nunca en el historial: no se acumula sin límite
+        errno = EFBIG;
+        ret = -1;
+    }
+    else
+    {
+        if (writer->pending_size - writer->pending_len < len)
+        {
+            size_t size = writer->pending_size ? 2 * writer->pending_size : BUFFER_SIZE;
+            while (size < writer->pending_len + len)
+                size *= 2;
+            char *pending = realloc(writer->pending, size);
+            if (!pending)
+                return -1;
+            writer->pending = pending;
+            writer->pending_size = size;
+        }
+        memcpy(writer->pending + writer->pending_len, buf, len);
+        writer->pending_len += len;
+        if (complete)
+        {
+            ret = memstore_add(writer->pending, writer->pending_len);
+            writer->pending_len = 0;
+        }
+    }
+
+    if (ret < 0)
+    {
+        syslog(LOG_ERR, "Write to %s failed: %s", datafile_path, strerror(errno));
+        return -1;
+    }
+    writer->written = true;
+    writer->partial = writer->pending_len > 0;
+    return 0;
+}
+
+/**
+ * Copia en *@param buf (que crece si hace falta; su tamaño va en
+ * *@param buf_size) el historial entero o, si @param seekto no es NULL,
+ * desde el comando y offset que indica, como el ioctl AESDCHAR_IOCSEEKTO.
+ * @return bytes copiados, -1 si @param seekto no existe (errno = EINVAL) o
+ *      no hubo memoria
+ */
+static ssize_t memstore_snapshot(const struct aesd_seekto *seekto, char **buf, size_t *buf_size)
+{
+    const char *span_ptr[2];
+    size_t span_len[2];
+    size_t start = 0;
+    size_t copied = 0;
+
+    pthread_rwlock_rdlock(&datafile.content_lock);
+    if (seekto && !aesd_circular_buffer_find_fpos_for_entry(&memstore.buffer, seekto->write_cmd,
+                                                            seekto->write_cmd_offset, &start))
+    {
+        pthread_rwlock_unlock(&datafile.content_lock);
+        errno = EINVAL;
+        return -1;
+    }
+
+    size_t len = aesd_circular_buffer_size(&memstore.buffer) - start;
+    if (len > *buf_size)
+    {
+        char *grown = realloc(*buf, len);
+        if (!grown)
+        {
+            pthread_rwlock_unlock(&datafile.content_lock);
+            return -1;
+        }
+        *buf = grown;
+        *buf_size = len;
+    }
+
+    size_t spans = aesd_circular_buffer_arena_spans(&memstore.buffer, start, len, span_ptr, span_len);
+    for (size_t i = 0; i < spans; i++)
+    {
+        memcpy(*buf + copied, span_ptr[i], span_len[i]);
+        copied += span_len[i];
+    }
+    pthread_rwlock_unlock(&datafile.content_lock);
+    return (ssize_t)copied;
+}
+
+/**
+ * Escribe @param len bytes de @param buf en DATAFILE usando el descriptor de
+ * escritura compartido. Cada llamada llega al driver como un único write().
+ * @return 0 si se escribió todo, -1 en caso de error (errno indica la causa)
+ */
+static int datafile_write(const char *buf, size_t len)
+{
+    int ret = 0;
+    bool retried = false;
+
+    if (datafile.store == DATAFILE_STORE_MMAP)
+    {
+        // Sólo lo usan las marcas de tiempo, que son siempre un comando completo
+        ret = memstore_add(buf, len);
+        if (ret < 0)
+            syslog(LOG_ERR, "Write to %s failed: %s", datafile_path, strerror(errno));
+        return ret;
+    }
+
+    pthread_mutex_lock(&datafile.lock);
+    datafile_check_reopen_locked();
+
+    while (len > 0)
+    {
+        if (datafile.write_fd < 0)
+        {
+            datafile.write_fd = open(datafile_path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+            if (datafile.write_fd < 0)
+            {
+                syslog(LOG_ERR, "File open failed: %s", strerror(errno));
+                ret = -1;
+                break;
+            }
+        }
+
+        pthread_rwlock_wrlock(&datafile.content_lock);
+        ssize_t written = write(datafile.write_fd, buf, len);
+        pthread_rwlock_unlock(&datafile.content_lock);
+        if (written < 0)
+        {
+            int err = errno;
+            if (err == EINTR)
+                continue;
+            if (datafile_error_is_stale(err) && !retried)
+            {
+                // El dispositivo pudo recargarse: reabrimos una única vez
+                retried = true;
+                close(datafile.write_fd);
+                datafile.write_fd = -1;
+                continue;
+            }
+            syslog(LOG_ERR, "Write to %s failed: %s", datafile_path, strerror(err));
+            errno = err;
+            ret = -1;
+            break;
+        }
+        buf += written;
+        len -= (size_t)written;
+    }
+
+    pthread_mutex_unlock(&datafile.lock);
+    return ret;
+}
+
+/**
+ * Asigna a @param writer un descriptor de escritura de la caché, o abre uno
+ * nuevo si la caché está vacía. No hace nada si ya tiene descriptor.
+ * @return 0 en caso de éxito, -1 si no se pudo abrir DATAFILE
+ */
+static int datafile_writer_open(datafile_writer_t *writer)
+{
+    if (writer->fd >= 0)
+        return 0;
+
+    pthread_mutex_lock(&datafile.lock);
+    datafile_check_reopen_locked();
+    writer->generation = datafile.generation;
+    if (datafile.num_write_fds > 0)
+        writer->fd = datafile.write_fds[--datafile.num_write_fds];
+    pthread_mutex_unlock(&datafile.lock);
+
+    if (writer->fd < 0)
+        writer->fd = open(datafile_path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (writer->fd < 0)
+    {
+        syslog(LOG_ERR, "File open failed: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Escribe @param len bytes de @param buf en DATAFILE por el descriptor propio
+ * de @param writer, que se toma de la caché (o se abre) en la primera llamada.
+ * Durante el write() sólo toma el lock de escritura de datafile.content_lock.
+ * @return 0 si se escribió todo, -1 en caso de error (errno indica la causa)
+ */
+static int datafile_writer_write(datafile_writer_t *writer, const char *buf, size_t len)
+{
+    bool retried = false;
+
+    if (len == 0)
+        return 0;
+    if (datafile.store == DATAFILE_STORE_MMAP)
+        return memstore_writer_write(writer, buf, len);
+
+    while (len > 0)
+    {
+        if (datafile_writer_open(writer) < 0)
+            return -1;
+
+        pthread_rwlock_wrlock(&datafile.content_lock);
+        ssize_t written = write(writer->fd, buf, len);
+        pthread_rwlock_unlock(&datafile.content_lock);
+        if (written < 0)
+        {
+            int err = errno;
+            if (err == EINTR)
+                continue;
+            // Sólo se reabre si no hay un comando a medias que se perdería con el descriptor
+            if (datafile_error_is_stale(err) && !retried && !writer->written)
+            {
+                retried = true;
+                close(writer->fd);
+                writer->fd = -1;
+                continue;
+            }
+            syslog(LOG_ERR, "Write to %s failed: %s", datafile_path, strerror(err));
+            errno = err;
+            return -1;
+        }
+        writer->written = true;
+        writer->partial = buf[written - 1] != '\n';
+        buf += written;
+        len -= (size_t)written;
+    }
+    return 0;
+}
+
+/**
+ * Devuelve el descriptor de @param writer a la caché. Se cierra en su lugar
+ * si @param failed es true, si los descriptores se descartaron mientras se
+ * usaba o si quedó un comando sin '\n' (al cerrarlo el driver lo descarta;
+ * reutilizarlo lo pegaría al paquete de otra conexión).
+ */
+static void datafile_writer_release(datafile_writer_t *writer, bool failed)
+{
+    // Con memstore el comando a medias se descarta, como al cerrar el driver
+    free(writer->pending);
+    writer->pending = NULL;
+    writer->pending_len = 0;
+    writer->pending_size = 0;
+
+    if (writer->fd < 0)
+        return;
+
+    pthread_mutex_lock(&datafile.lock);
+    if (!failed && !writer->partial && writer->generation == datafile.generation &&
+        datafile.num_write_fds < WRITE_FD_CACHE_SIZE)
+    {
+        datafile.write_fds[datafile.num_write_fds++] = writer->fd;
+        writer->fd = -1;
+    }
+    pthread_mutex_unlock(&datafile.lock);
+
+    if (writer->fd >= 0)
+    {
+        close(writer->fd);
+        writer->fd = -1;
+    }
+}
+
+/**
+ * Obtiene un descriptor de lectura de la caché (o abre uno nuevo).
+ * La posición del descriptor no está definida; el llamante debe hacer lseek
+ * o el ioctl de búsqueda antes de leer.
+ * @return 0 en caso de éxito, -1 si no se pudo abrir DATAFILE
+ */
+static int datafile_acquire_reader(datafile_reader_t *reader)
+{
+    pthread_mutex_lock(&datafile.lock);
+    datafile_check_reopen_locked();
+    reader->generation = datafile.generation;
+    if (datafile.num_read_fds > 0)
+    {
+        reader->fd = datafile.read_fds[--datafile.num_read_fds];
+        pthread_mutex_unlock(&datafile.lock);
+        return 0;
+    }
+    pthread_mutex_unlock(&datafile.lock);
+
+    reader->fd = open(datafile_path, O_RDONLY | O_CLOEXEC);
+    if (reader->fd < 0)
+    {
+        syslog(LOG_ERR, "Failed to open %s for reading: %s", datafile_path, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Devuelve @param reader a la caché. Si @param failed es true, o los
+ * descriptores se descartaron mientras se usaba, se cierra en su lugar.
+ */
+static void datafile_release_reader(datafile_reader_t *reader, bool failed)
+{
+    pthread_mutex_lock(&datafile.lock);
+    if (!failed && reader->generation == datafile.generation &&
+        datafile.num_read_fds < READ_FD_CACHE_SIZE)
+    {
+        datafile.read_fds[datafile.num_read_fds++] = reader->fd;
+        reader->fd = -1;
+    }
+    pthread_mutex_unlock(&datafile.lock);
+
+    if (reader->fd >= 0)
+    {
+        close(reader->fd);
+        reader->fd = -1;
+    }
+}
+
+/**
+ * Envía por el socket lo que quede de *@param buf (*@param len bytes) y
+ * avanza ambos según lo enviado.
+ * @return 0 si se envió todo, 1 si el socket (no bloqueante) no admite más
+ *      por ahora, -1 si falló el envío
+ */
+static int send_pending(int client_fd, const char **buf, size_t *len)
+{
+    while (*len > 0)
+    {
+        ssize_t sent = send(client_fd, *buf, *len, MSG_NOSIGNAL);
+        if (sent < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 1 : -1;
+        }
+        *buf += sent;
+        *len -= (size_t)sent;
+    }
+    return 0;
+}
+
+/**
+ * Envía al cliente los bytes [*@param start, @param end) de @param fd, un
+ * fichero normal, y avanza *@param start según lo enviado. Usa sendfile con
+ * offset explícito (el fichero entrega los datos al socket sin pasar por
+ * espacio de usuario y no se toca f_pos) y, si el origen no lo admite, el
+ * bucle pread/send sobre @param buf. Lo enviado se cuenta desde el offset,
+ * así un envío a medias se retoma sin guardar datos.
+ * @return 0 si se envió todo, 1 si el socket (no bloqueante) no admite más
+ *      por ahora, -1 si falló la lectura o el envío. En @param read_failed
+ *      se indica si el fallo fue del descriptor de origen.
+ */
+static int echo_range_to_client(int client_fd, int fd, off_t *start, off_t end, char *buf, bool *read_failed)
+{
+    *read_failed = false;
+
+    pthread_mutex_lock(&datafile.lock);
+    bool try_sendfile = !datafile.sendfile_unsupported;
+    pthread_mutex_unlock(&datafile.lock);
+
+    while (try_sendfile && *start < end)
+    {
+        size_t chunk = end - *start < SENDFILE_CHUNK ? (size_t)(end - *start) : SENDFILE_CHUNK;
+        ssize_t sent = sendfile(client_fd, fd, start, chunk);
+        if (sent > 0)
+            continue;
+        if (sent == 0)
+            return 0;
+        if (errno == EINTR)
+            continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return 1;
+        if (errno == EINVAL || errno == ENOSYS)
+        {
+            // El origen no soporta splice: recordarlo y pasar a la copia
+            syslog(LOG_INFO, "sendfile not supported by %s, using read/send", datafile_path);
+            pthread_mutex_lock(&datafile.lock);
+            datafile.sendfile_unsupported = true;
+            pthread_mutex_unlock(&datafile.lock);
+            break;
+        }
+        // Sólo descartamos el descriptor si el error viene del origen
+        *read_failed = datafile_error_is_stale(errno);
+        return -1;
+    }
+
+    while (*start < end)
+    {
+        size_t chunk = end - *start < BUFFER_SIZE ? (size_t)(end - *start) : BUFFER_SIZE;
+        ssize_t bytes_read = pread(fd, buf, chunk, *start);
+        if (bytes_read < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            *read_failed = true;
+            return -1;
+        }
+        if (bytes_read == 0)
+            return 0;
+
+        const char *pending = buf;
+        size_t len = (size_t)bytes_read;
+        int ret = send_pending(client_fd, &pending, &len);
+        *start += bytes_read - (off_t)len;
+        if (ret != 0)
+            return ret;
+    }
+    return 0;
+}
 
 void signal_handler(int sig)
 {
@@ -40,229 +771,1472 @@ void signal_handler(int sig)
     syslog(LOG_INFO, "Caught signal, exiting");
 }
 
-// HILO DEL TEMPORIZADOR (Escribe cada 10s)
+void reopen_handler(int sig)
+{
+    (void)sig;
+    reopen_requested = 1;
+}
+
+/*
+ * Marcas de tiempo periódicas.
+ *
+ * Un timerfd periódico sobre CLOCK_MONOTONIC marca cada intervalo: el kernel
+ * programa cada vencimiento a partir del anterior, así el intervalo no deriva
+ * con lo que tarde en escribirse la marca ni con cambios de la hora del
+ * sistema. En los modos -e y -u el timerfd forma parte del bucle de eventos;
+ * en el modo de hilos lo espera timer_thread() bloqueado en read(), sin
+ * despertar mientras no vence.
+ */
+
+// Crea el timerfd que vence cada @param interval segundos. @return fd, -1 en caso de error
+static int timestamp_timer_create(unsigned int interval)
+{
+    struct itimerspec spec = {.it_interval = {.tv_sec = interval}, .it_value = {.tv_sec = interval}};
+    int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+
+    if (timer_fd < 0)
+    {
+        syslog(LOG_ERR, "timerfd_create failed: %s", strerror(errno));
+        return -1;
+    }
+    if (timerfd_settime(timer_fd, 0, &spec, NULL) < 0)
+    {
+        syslog(LOG_ERR, "timerfd_settime failed: %s", strerror(errno));
+        close(timer_fd);
+        return -1;
+    }
+    // localtime_r no relee la zona horaria en cada llamada
+    tzset();
+    return timer_fd;
+}
+
+// Hace vencer el timer de inmediato para que timer_thread() vea exit_requested
+static void timestamp_timer_wake(int timer_fd)
+{
+    struct itimerspec spec = {.it_value = {.tv_nsec = 1}};
+
+    timerfd_settime(timer_fd, 0, &spec, NULL);
+}
+
+// Añade a DATAFILE la marca de tiempo actual en formato RFC 2822
+static void timestamp_write(void)
+{
+    time_t now = time(NULL);
+    struct tm info;
+    char text[100];
+    size_t len;
+
+    localtime_r(&now, &info);
+    // Formato RFC 2822: %a, %d %b %Y %H:%M:%S %z
+    len = strftime(text, sizeof(text), "timestamp:%a, %d %b %Y %H:%M:%S %z\n", &info);
+    datafile_write(text, len);
+}
+
+// Consume los vencimientos pendientes de @param timer_fd y escribe una marca
+static void timestamp_timer_expired(int timer_fd)
+{
+    uint64_t expirations;
+
+    if (read(timer_fd, &expirations, sizeof(expirations)) == (ssize_t)sizeof(expirations))
+        timestamp_write();
+}
+
+// Modo de hilos: espera al timerfd recibido en @param arg
 void *timer_thread(void *arg)
 {
-    (void)arg;
+    int timer_fd = *(int *)arg;
+
     while (!exit_requested)
     {
-        // Esperar 10 segundos (usando sleep en intervalos cortos para responder rápido al exit)
-        for (int i = 0; i < 10 && !exit_requested; i++)
-        {
-            sleep(1);
-        }
+        uint64_t expirations;
+        ssize_t n = read(timer_fd, &expirations, sizeof(expirations));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n != (ssize_t)sizeof(expirations) || exit_requested)
+            break;
+        timestamp_write();
+    }
+    return NULL;
+}
+
+/**
+ * Reinicia @param framer para una conexión nueva.
+ */
+static void framer_init(framer_t *framer)
+{
+    memset(framer, 0, sizeof(*framer));
+}
+
+// Entrega al framer el siguiente trozo recibido; debe consumirse entero antes del siguiente
+static void framer_feed(framer_t *framer, const char *buf, size_t len)
+{
+    framer->in = buf;
+    framer->in_len = len;
+}
+
+/**
+ * Extrae el siguiente fragmento del flujo entregado con framer_feed().
+ * Las líneas que empiezan por "AESDCHAR_IOCSEEKTO:" se retienen en
+ * framer->hold hasta ver el '\n' (o saber que no son un comando), así el
+ * comando se reconoce aunque llegue partido en varios recv o detrás de
+ * otros paquetes del mismo trozo. El puntero devuelto en @param data sólo
+ * es válido hasta la siguiente llamada.
+ * @return FRAME_DATA: @param data/@param len son parte de un paquete, sin '\n';
+ *         FRAME_PACKET: @param data/@param len terminan un paquete ('\n' incluido);
+ *         FRAME_SEEKTO: comando completo en framer->write_cmd/write_cmd_offset;
+ *         FRAME_NONE: hace falta otro trozo
+ */
+static frame_kind_t framer_next(framer_t *framer, const char **data, size_t *len)
+{
+    while (framer->in_len > 0)
+    {
+        if (framer->in_data)
+        {
+            const char *newline = memchr(framer->in, '\n', framer->in_len);
+            size_t n = newline ? (size_t)(newline - framer->in) + 1 : framer->in_len;
+
+            *data = framer->in;
+            *len = n;
+            framer->in += n;
+            framer->in_len -= n;
+            if (!newline)
+                return FRAME_DATA;
+            framer->in_data = false;
+            return FRAME_PACKET;
+        }
+
+        // Principio de línea o línea que todavía puede ser un comando
+        char c = *framer->in;
+        bool is_command = framer->hold_len < FRAMER_HOLD_SIZE - 1 &&
+                          (framer->hold_len >= SEEKTO_PREFIX_LEN || c == SEEKTO_PREFIX[framer->hold_len]);
+        if (!is_command)
+        {
+            framer->in_data = true;
+            if (framer->hold_len > 0)
+            {
+                // Lo retenido era el principio de un paquete normal
+                *data = framer->hold;
+                *len = framer->hold_len;
+                framer->hold_len = 0;
+                return FRAME_DATA;
+            }
+            continue;
+        }
+
+        framer->hold[framer->hold_len++] = c;
+        framer->in++;
+        framer->in_len--;
+        if (c == '\n')
+        {
+            *data = framer->hold;
+            *len = framer->hold_len;
+            framer->hold[framer->hold_len] = '\0';
+            framer->hold_len = 0;
+            if (sscanf(framer->hold + SEEKTO_PREFIX_LEN, "%u,%u", &framer->write_cmd, &framer->write_cmd_offset) == 2)
+                return FRAME_SEEKTO;
+            // Comando mal formado: se guarda como un paquete más
+            return FRAME_PACKET;
+        }
+    }
+    return FRAME_NONE;
+}
+
+/**
+ * Copia en el buffer de instantánea de @param data el contenido de @param fd
+ * desde su posición actual hasta EOF (el dispositivo no tiene tamaño: se lee
+ * hasta que read() devuelve 0).
+ * @return bytes copiados, -1 si falló la lectura o no hubo memoria
+ */
+static ssize_t connection_snapshot(thread_data_t *data, int fd)
+{
+    size_t len = 0;
+
+    for (;;)
+    {
+        if (data->snapshot_size - len < BUFFER_SIZE)
+        {
+            size_t size = data->snapshot_size ? 2 * data->snapshot_size : 4 * BUFFER_SIZE;
+            char *snapshot = realloc(data->snapshot, size);
+            if (!snapshot)
+                return -1;
+            data->snapshot = snapshot;
+            data->snapshot_size = size;
+        }
+
+        ssize_t bytes_read = read(fd, data->snapshot + len, data->snapshot_size - len);
+        if (bytes_read < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (bytes_read == 0)
+            return (ssize_t)len;
+        len += (size_t)bytes_read;
+    }
+}
+
+// Libera la instantánea del último eco: no se guarda mientras la conexión espera
+static void connection_drop_snapshot(thread_data_t *data)
+{
+    free(data->snapshot);
+    data->snapshot = NULL;
+    data->snapshot_size = 0;
+}
+
+/**
+ * Envía lo que quede del último eco de @param data y, al terminarlo, libera
+ * su instantánea.
+ * @return 0 si no queda nada, 1 si el socket no admite más por ahora, -1 si
+ *      falló el envío al cliente (un fallo de lectura sólo termina el eco)
+ */
+static int connection_flush(thread_data_t *data)
+{
+    int ret = send_pending(data->client_fd, &data->out_buf, &data->out_len);
+
+    if (ret == 0 && data->out_reader.fd >= 0)
+    {
+        bool reader_failed;
+
+        ret = echo_range_to_client(data->client_fd, data->out_reader.fd, &data->out_pos, data->out_end,
+                                   data->send_buf, &reader_failed);
+        if (ret == 1)
+            return 1;
+        datafile_release_reader(&data->out_reader, reader_failed);
+        if (reader_failed)
+            ret = 0;
+    }
+    if (ret == 0)
+        connection_drop_snapshot(data);
+    return ret;
+}
+
+// connection_echo() con memstore: la instantánea se copia sin tocar descriptores
+static int connection_echo_memstore(thread_data_t *data, bool seekto)
+{
+    struct aesd_seekto cmd = {.write_cmd = data->framer.write_cmd, .write_cmd_offset = data->framer.write_cmd_offset};
+
+    if (seekto)
+        syslog(LOG_INFO, "Processing AESDCHAR_IOCSEEKTO: cmd=%u, offset=%u", cmd.write_cmd, cmd.write_cmd_offset);
+    ssize_t len = memstore_snapshot(seekto ? &cmd : NULL, &data->snapshot, &data->snapshot_size);
+    if (len < 0)
+    {
+        syslog(LOG_ERR, "Seek in %s failed: %s", datafile_path, strerror(errno));
+        connection_drop_snapshot(data);
+        return 0;
+    }
+    data->out_buf = data->snapshot;
+    data->out_len = (size_t)len;
+    return connection_flush(data);
+}
+
+/**
+ * Contesta al cliente de @param data con el contenido de DATAFILE: entero o,
+ * si @param seekto es true, desde la posición del comando
+ * AESDCHAR_IOCSEEKTO guardado en el framer.
+ * El contenido se fija bajo el lock de lectura de datafile.content_lock (en
+ * un fichero normal, de sólo añadir, basta con su tamaño; del dispositivo se
+ * copia a memoria) y se envía ya sin lock, así un cliente lento no frena a
+ * los escritores ni a los demás ecos. El dispositivo no se envía con
+ * sendfile: su f_pos cuenta desde el comando más antiguo y se desplaza
+ * cuando se descarta uno, así que leerlo sin lock repetiría o saltaría
+ * bytes. Lo que el socket no admita queda en data->out_* para
+ * connection_flush().
+ * @return 0 si se envió todo, 1 si queda eco por enviar, -1 si falló el
+ *      envío al cliente
+ */
+static int connection_echo(thread_data_t *data, bool seekto)
+{
+    datafile_reader_t reader;
+    bool reader_failed = false;
+    bool ioctl_failed = false;
+    bool regular = false;
+    off_t start = 0;
+    off_t end = 0;
+    ssize_t snapshot_len = 0;
+    struct stat st;
+
+    if (datafile.store == DATAFILE_STORE_MMAP)
+        return connection_echo_memstore(data, seekto);
+    if (datafile_acquire_reader(&reader) < 0)
+        return 0;
+
+    pthread_rwlock_rdlock(&datafile.content_lock);
+    if (seekto)
+    {
+        // El ioctl mueve f_pos de este descriptor: la lectura usa el mismo
+        struct aesd_seekto cmd = {.write_cmd = data->framer.write_cmd,
+                                  .write_cmd_offset = data->framer.write_cmd_offset};
+
+        syslog(LOG_INFO, "Processing AESDCHAR_IOCSEEKTO: cmd=%u, offset=%u", cmd.write_cmd, cmd.write_cmd_offset);
+        if (ioctl(reader.fd, AESDCHAR_IOCSEEKTO, &cmd) != 0)
+        {
+            syslog(LOG_ERR, "ioctl failed: %s", strerror(errno));
+            reader_failed = datafile_error_is_stale(errno);
+            ioctl_failed = true;
+        }
+    }
+    else
+    {
+        reader_failed = lseek(reader.fd, 0, SEEK_SET) < 0;
+    }
+
+    if (!reader_failed && !ioctl_failed)
+    {
+        start = lseek(reader.fd, 0, SEEK_CUR);
+        regular = start >= 0 && fstat(reader.fd, &st) == 0 && S_ISREG(st.st_mode);
+        if (regular)
+            end = st.st_size;
+        else if ((snapshot_len = connection_snapshot(data, reader.fd)) < 0)
+            reader_failed = true;
+    }
+    pthread_rwlock_unlock(&datafile.content_lock);
+
+    // El envío, que dura lo que tarde el cliente, va fuera del lock
+    if (regular)
+    {
+        // El descriptor se queda con la conexión hasta terminar el rango
+        data->out_reader = reader;
+        data->out_pos = start;
+        data->out_end = end;
+        return connection_flush(data);
+    }
+    datafile_release_reader(&reader, reader_failed);
+    if (snapshot_len <= 0)
+    {
+        connection_drop_snapshot(data);
+        return 0;
+    }
+    data->out_buf = data->snapshot;
+    data->out_len = (size_t)snapshot_len;
+    return connection_flush(data);
+}
+
+// Prepara @param data para atender una conexión recién aceptada
+static void connection_init(thread_data_t *data, int client_fd, const struct sockaddr_in *client_addr)
+{
+    data->client_fd = client_fd;
+    data->client_addr = *client_addr;
+    data->completed = false;
+    data->next = NULL;
+    data->writer = (datafile_writer_t)DATAFILE_WRITER_INIT;
+    data->write_failed = false;
+    data->snapshot = NULL;
+    data->snapshot_size = 0;
+    data->out_buf = NULL;
+    data->out_len = 0;
+    data->out_reader.fd = -1;
+    framer_init(&data->framer);
+}
+
+/**
+ * Atiende los paquetes que envía el cliente de @param data: cada paquete
+ * (delimitado por '\n') se escribe en DATAFILE y se contesta, en orden y
+ * sobre la misma conexión, antes de pasar al siguiente. Con
+ * @param nonblocking vuelve en cuanto haya que esperar al cliente, para que
+ * lea el eco o mande más datos, en lugar de bloquearse; la siguiente
+ * llamada sigue por el resto del eco y del trozo recibido.
+ * @return CONNECTION_WAIT_READ o CONNECTION_WAIT_WRITE si la conexión sigue
+ *      abierta (sólo con @param nonblocking), CONNECTION_CLOSED si el
+ *      cliente cerró o hubo un error
+ */
+static connection_state_t connection_process(thread_data_t *data, bool nonblocking)
+{
+    while (!exit_requested)
+    {
+        const char *frame;
+        size_t frame_len;
+        frame_kind_t kind;
+        int ret = connection_flush(data);
+
+        while (ret == 0 && (kind = framer_next(&data->framer, &frame, &frame_len)) != FRAME_NONE)
+        {
+            if (kind == FRAME_SEEKTO)
+            {
+                ret = connection_echo(data, true);
+                continue;
+            }
+
+            // Descriptor propio: sin lock global, el driver no mezcla paquetes de otras conexiones
+            if (datafile_writer_write(&data->writer, frame, frame_len) < 0)
+            {
+                data->write_failed = true;
+                return CONNECTION_CLOSED;
+            }
+            if (kind == FRAME_PACKET)
+                ret = connection_echo(data, false);
+        }
+        if (ret != 0)
+            return ret > 0 ? CONNECTION_WAIT_WRITE : CONNECTION_CLOSED;
+
+        ssize_t bytes_received = recv(data->client_fd, data->recv_buf, BUFFER_SIZE, nonblocking ? MSG_DONTWAIT : 0);
+        if (bytes_received < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return nonblocking && (errno == EAGAIN || errno == EWOULDBLOCK) ? CONNECTION_WAIT_READ
+                                                                             : CONNECTION_CLOSED;
+        }
+        if (bytes_received == 0)
+            return CONNECTION_CLOSED;
+        framer_feed(&data->framer, data->recv_buf, (size_t)bytes_received);
+    }
+    return CONNECTION_CLOSED;
+}
+
+// Libera los recursos de la conexión y cierra el socket
+static void connection_close(thread_data_t *data)
+{
+    char client_ip[INET_ADDRSTRLEN];
+
+    datafile_writer_release(&data->writer, data->write_failed);
+    if (data->out_reader.fd >= 0)
+        datafile_release_reader(&data->out_reader, false);
+    close(data->client_fd);
+    connection_drop_snapshot(data);
+    inet_ntop(AF_INET, &data->client_addr.sin_addr, client_ip, sizeof(client_ip));
+    syslog(LOG_INFO, "Closed connection from %s", client_ip);
+}
+
+// Modo de hilos: protege client_fd de las conexiones vivas frente al shutdown final
+static pthread_mutex_t thread_list_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void *handle_connection(void *arg)
+{
+    thread_data_t *data = (thread_data_t *)arg;
+
+    connection_process(data, false);
+    pthread_mutex_lock(&thread_list_lock);
+    connection_close(data);
+    data->completed = true;
+    pthread_mutex_unlock(&thread_list_lock);
+    return arg;
+}
+
+/*
+ * Pool de hilos para el modo epoll (-e).
+ *
+ * El hilo principal acepta conexiones sobre un socket no bloqueante y registra
+ * cada cliente en epoll con EPOLLONESHOT; sólo cuando el cliente tiene datos
+ * listos se encola para que uno de los workers atienda los paquetes recibidos.
+ * Cuando el cliente se queda sin datos, el worker devuelve la conexión a
+ * epoll en lugar de esperarle, así una conexión persistente inactiva no
+ * ocupa un worker. Los sockets de cliente no bloquean: si un cliente no lee
+ * el eco al ritmo al que se envía, lo que falta queda en la conexión y ésta
+ * vuelve a epoll con EPOLLOUT, así un cliente lento tampoco retiene a un
+ * worker.
+ * El número de workers es fijo (uno por CPU) y el número de conexiones vivas
+ * está acotado por MAX_PENDING_CONNECTIONS. Todas están en la lista live,
+ * también las que esperan en epoll, para cerrarlas en pool_destroy().
+ */
+typedef struct worker_pool
+{
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    thread_data_t *queue_head;
+    thread_data_t *queue_tail;
+    size_t outstanding; // aceptadas y todavía no cerradas
+    thread_data_t *live; // esas mismas conexiones
+    bool shutdown;
+    bool listen_paused;
+    int epoll_fd;
+    int listen_fd;
+    pthread_t *workers;
+    long num_workers;
+} worker_pool_t;
+
+static void pool_enqueue(worker_pool_t *pool, thread_data_t *conn)
+{
+    pthread_mutex_lock(&pool->lock);
+    conn->next = NULL;
+    if (pool->queue_tail)
+        pool->queue_tail->next = conn;
+    else
+        pool->queue_head = conn;
+    pool->queue_tail = conn;
+    pthread_cond_signal(&pool->not_empty);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// Añade @param conn a la lista de conexiones vivas; con pool->lock tomado
+static void pool_live_add(worker_pool_t *pool, thread_data_t *conn)
+{
+    conn->live_prev = NULL;
+    conn->live_next = pool->live;
+    if (pool->live)
+        pool->live->live_prev = conn;
+    pool->live = conn;
+}
+
+// Quita @param conn de la lista de conexiones vivas; con pool->lock tomado
+static void pool_live_remove(worker_pool_t *pool, thread_data_t *conn)
+{
+    if (conn->live_prev)
+        conn->live_prev->live_next = conn->live_next;
+    else
+        pool->live = conn->live_next;
+    if (conn->live_next)
+        conn->live_next->live_prev = conn->live_prev;
+}
+
+// @param conn ya está cerrada: deja de contar y, si hace falta, reanuda el accept
+static void pool_connection_done(worker_pool_t *pool, thread_data_t *conn)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool_live_remove(pool, conn);
+    pool->outstanding--;
+    if (pool->listen_paused && pool->outstanding < MAX_PENDING_CONNECTIONS)
+    {
+        // Volvemos a escuchar: hay hueco para nuevas conexiones
+        struct epoll_event ev = {.events = EPOLLIN, .data.ptr = NULL};
+        if (epoll_ctl(pool->epoll_fd, EPOLL_CTL_MOD, pool->listen_fd, &ev) == 0)
+            pool->listen_paused = false;
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static void *pool_worker(void *arg)
+{
+    worker_pool_t *pool = (worker_pool_t *)arg;
+
+    while (1)
+    {
+        pthread_mutex_lock(&pool->lock);
+        while (!pool->queue_head && !pool->shutdown)
+            pthread_cond_wait(&pool->not_empty, &pool->lock);
+        if (!pool->queue_head)
+        {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+        thread_data_t *conn = pool->queue_head;
+        pool->queue_head = conn->next;
+        if (!pool->queue_head)
+            pool->queue_tail = NULL;
+        pthread_mutex_unlock(&pool->lock);
+
+        connection_state_t state = connection_process(conn, true);
+        if (state != CONNECTION_CLOSED)
+        {
+            // Vuelve a epoll hasta el siguiente paquete o hasta que el cliente lea el eco.
+            // Sin EPOLLRDHUP al esperar a escribir: un cliente que ya cerró su lado
+            // de escritura pero sigue leyendo despertaría al worker sin parar
+            struct epoll_event ev = {.events = state == CONNECTION_WAIT_WRITE ? EPOLLOUT | EPOLLONESHOT
+                                                                              : EPOLLIN | EPOLLRDHUP | EPOLLONESHOT,
+                                     .data.ptr = conn};
+            if (epoll_ctl(pool->epoll_fd, EPOLL_CTL_MOD, conn->client_fd, &ev) == 0)
+                continue;
+        }
+        connection_close(conn);
+        pool_connection_done(pool, conn);
+        free(conn);
+    }
+    return NULL;
+}
+
+static int pool_init(worker_pool_t *pool, int listen_fd)
+{
+    memset(pool, 0, sizeof(*pool));
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->not_empty, NULL);
+    pool->listen_fd = listen_fd;
+
+    pool->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (pool->epoll_fd < 0)
+    {
+        syslog(LOG_ERR, "epoll_create1 failed: %s", strerror(errno));
+        return -1;
+    }
+
+    pool->num_workers = sysconf(_SC_NPROCESSORS_ONLN);
+    if (pool->num_workers < 1)
+        pool->num_workers = 1;
+    pool->workers = calloc(pool->num_workers, sizeof(pthread_t));
+    if (!pool->workers)
+    {
+        close(pool->epoll_fd);
+        return -1;
+    }
+
+    for (long i = 0; i < pool->num_workers; i++)
+    {
+        if (pthread_create(&pool->workers[i], NULL, pool_worker, pool) != 0)
+        {
+            syslog(LOG_ERR, "pthread_create failed for worker %ld", i);
+            pool->num_workers = i;
+            break;
+        }
+    }
+    syslog(LOG_INFO, "Started %ld worker threads", pool->num_workers);
+    return pool->num_workers > 0 ? 0 : -1;
+}
+
+static void pool_destroy(worker_pool_t *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->shutdown = true;
+    pthread_cond_broadcast(&pool->not_empty);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (long i = 0; i < pool->num_workers; i++)
+        pthread_join(pool->workers[i], NULL);
+
+    // Sin workers: las que quedan esperan en epoll a que el cliente lea o envíe
+    while (pool->live)
+    {
+        thread_data_t *conn = pool->live;
+
+        pool->live = conn->live_next;
+        connection_close(conn);
+        free(conn);
+    }
+
+    free(pool->workers);
+    close(pool->epoll_fd);
+    pthread_cond_destroy(&pool->not_empty);
+    pthread_mutex_destroy(&pool->lock);
+}
+
+// Acepta todas las conexiones pendientes del socket no bloqueante
+static void accept_pending(worker_pool_t *pool)
+{
+    while (!exit_requested)
+    {
+        pthread_mutex_lock(&pool->lock);
+        if (pool->outstanding >= MAX_PENDING_CONNECTIONS)
+        {
+            // Demasiadas conexiones vivas: dejamos de vigilar el socket de escucha
+            struct epoll_event ev = {.events = 0, .data.ptr = NULL};
+            if (epoll_ctl(pool->epoll_fd, EPOLL_CTL_MOD, pool->listen_fd, &ev) == 0)
+                pool->listen_paused = true;
+            pthread_mutex_unlock(&pool->lock);
+            return;
+        }
+        pthread_mutex_unlock(&pool->lock);
+
+        struct sockaddr_in client_addr;
+        socklen_t client_len = sizeof(client_addr);
+        int client_fd = accept4(pool->listen_fd, (struct sockaddr *)&client_addr, &client_len,
+                                SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_fd < 0)
+        {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                syslog(LOG_ERR, "Accept failed: %s", strerror(errno));
+            return;
+        }
+
+        thread_data_t *conn = malloc(sizeof(thread_data_t));
+        if (!conn)
+        {
+            close(client_fd);
+            continue;
+        }
+        connection_init(conn, client_fd, &client_addr);
+
+        // Sólo pasa a un worker cuando el cliente tenga datos
+        struct epoll_event ev = {.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT, .data.ptr = conn};
+        if (epoll_ctl(pool->epoll_fd, EPOLL_CTL_ADD, client_fd, &ev) < 0)
+        {
+            syslog(LOG_ERR, "epoll_ctl add client failed: %s", strerror(errno));
+            close(client_fd);
+            free(conn);
+            continue;
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        pool->outstanding++;
+        pool_live_add(pool, conn);
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+// data.ptr del timerfd en epoll
+static int epoll_timer_tag;
+
+static int run_event_loop(int server_fd, int timer_fd)
+{
+    worker_pool_t pool;
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+
+    int flags = fcntl(server_fd, F_GETFL, 0);
+    if (flags < 0 || fcntl(server_fd, F_SETFL, flags | O_NONBLOCK) < 0)
+    {
+        syslog(LOG_ERR, "Failed to set listen socket non-blocking: %s", strerror(errno));
+        return -1;
+    }
+
+    if (pool_init(&pool, server_fd) < 0)
+        return -1;
+
+    // data.ptr == NULL identifica al socket de escucha
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = NULL};
+    if (epoll_ctl(pool.epoll_fd, EPOLL_CTL_ADD, server_fd, &ev) < 0)
+    {
+        syslog(LOG_ERR, "epoll_ctl add listen failed: %s", strerror(errno));
+        pool_destroy(&pool);
+        return -1;
+    }
+    struct epoll_event timer_ev = {.events = EPOLLIN, .data.ptr = &epoll_timer_tag};
+    if (timer_fd >= 0 && epoll_ctl(pool.epoll_fd, EPOLL_CTL_ADD, timer_fd, &timer_ev) < 0)
+    {
+        syslog(LOG_ERR, "epoll_ctl add timer failed: %s", strerror(errno));
+        pool_destroy(&pool);
+        return -1;
+    }
+
+    while (!exit_requested)
+    {
+        int n = epoll_wait(pool.epoll_fd, events, MAX_EPOLL_EVENTS, -1);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            syslog(LOG_ERR, "epoll_wait failed: %s", strerror(errno));
+            break;
+        }
+
+        for (int i = 0; i < n; i++)
+        {
+            thread_data_t *conn = events[i].data.ptr;
+            if (!conn)
+            {
+                accept_pending(&pool);
+                continue;
+            }
+            if (conn == (thread_data_t *)&epoll_timer_tag)
+            {
+                timestamp_timer_expired(timer_fd);
+                continue;
+            }
+            // EPOLLONESHOT ya desactivó el cliente: el worker lo rearma si sigue abierto
+            pool_enqueue(&pool, conn);
+        }
+    }
+
+    pool_destroy(&pool);
+    return 0;
+}
+
+/*
+ * Backend io_uring (-u).
+ *
+ * Un único hilo atiende todas las conexiones con un anillo io_uring creado
+ * con las llamadas al sistema directamente (sin liburing). accept, recv,
+ * write al fichero de datos, read del fichero de datos y send se preparan
+ * como SQE y se entregan al kernel en un solo io_uring_enter por vuelta del
+ * bucle. El write de cada paquete va enlazado (IOSQE_IO_LINK) con el primer
+ * read de su eco, y el de un fragmento que agota el trozo recibido con el
+ * siguiente recv: si el write falla el kernel cancela la operación enlazada.
+ * El comando AESDCHAR_IOCSEEKTO se resuelve con ioctl síncrono (io_uring no
+ * lo admite) y el eco se lee después desde la posición que deja el ioctl.
+ * Con memstore (-s mmap) no hay descriptor: el comando se añade y el eco se
+ * copia a echo_buf en el propio hilo, y sólo el send pasa por el anillo.
+ * Si el kernel no soporta io_uring o alguna de esas operaciones, main()
+ * vuelve al modo de hilos.
+ */
+#ifdef HAVE_IO_URING
+
+#define URING_ENTRIES 256
+// Tamaño de cada read/send del eco: el fichero entero se devuelve en cada paquete
+#define URING_ECHO_SIZE (64 * 1024)
+// Como mucho dos operaciones en vuelo por conexión más el accept
+#define URING_CQ_ENTRIES (4 * MAX_PENDING_CONNECTIONS)
+
+typedef struct uring
+{
+    int fd;
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int *sq_mask;
+    unsigned int *sq_array;
+    unsigned int sq_entries;
+    unsigned int sq_local_tail; // incluye los SQE preparados y aún no publicados
+    struct io_uring_sqe *sqes;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+} uring_t;
+
+// Operación de cada SQE; va en los bits bajos de user_data junto al puntero a la conexión
+typedef enum uring_op
+{
+    URING_OP_ACCEPT,
+    URING_OP_RECV,
+    URING_OP_WRITE,
+    URING_OP_READ,
+    URING_OP_SEND,
+    URING_OP_TIMER,
+} uring_op_t;
+
+#define URING_OP_MASK 7u
+
+typedef struct uring_conn
+{
+    int client_fd;
+    datafile_writer_t writer;
+    datafile_reader_t reader; // fd == -1 mientras no hay eco
+    unsigned int inflight;    // SQE enviados cuyo CQE no ha llegado
+    bool done;                // no se preparan más operaciones
+    bool write_failed;
+    bool reader_failed;
+    size_t write_len;   // bytes del write en vuelo
+    bool write_newline; // el write en vuelo termina en '\n'
+    bool write_linked;  // el write en vuelo lleva enlazada la operación siguiente
+    framer_t framer;
+    off_t read_pos;
+    size_t send_off;
+    size_t send_len;
+    char *echo_buf; // URING_ECHO_SIZE bytes, se reserva al empezar el eco
+    size_t echo_size;   // memstore: bytes reservados en echo_buf
+    bool echo_snapshot; // memstore: echo_buf tiene el eco entero, no se lee más
+    struct uring_conn *prev;
+    struct uring_conn *next;
+    char buf[BUFFER_SIZE];
+} uring_conn_t;
+
+typedef struct uring_server
+{
+    uring_t ring;
+    int listen_fd;
+    bool accept_armed;
+    int timer_fd; // -1 sin marcas de tiempo
+    uint64_t timer_expirations;
+    size_t outstanding;
+    uring_conn_t *conns;
+} uring_server_t;
+
+static void uring_destroy(uring_t *ring)
+{
+    if (ring->sqes)
+        munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring && ring->cq_ring != ring->sq_ring)
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    if (ring->sq_ring)
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+}
+
+// Comprueba que el kernel implementa todas las operaciones que usa el backend
+static bool uring_supports_ops(uring_t *ring)
+{
+    static const int ops[] = {IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SEND, IORING_OP_READ, IORING_OP_WRITE};
+    size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, size);
+    bool supported = probe != NULL;
+
+    if (supported && syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE, probe, 256) < 0)
+        supported = false;
+    for (size_t i = 0; supported && i < sizeof(ops) / sizeof(ops[0]); i++)
+    {
+        if (ops[i] > probe->last_op || !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED))
+            supported = false;
+    }
+    free(probe);
+    return supported;
+}
+
+/**
+ * Crea el anillo y proyecta sus colas en memoria.
+ * @return 0 en caso de éxito, -1 si io_uring no está disponible
+ */
+static int uring_init(uring_t *ring)
+{
+    struct io_uring_params params;
+
+    memset(ring, 0, sizeof(*ring));
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = URING_CQ_ENTRIES;
+
+    ring->fd = (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if (ring->fd < 0)
+    {
+        syslog(LOG_ERR, "io_uring_setup failed: %s", strerror(errno));
+        return -1;
+    }
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    // Con IORING_FEAT_SINGLE_MMAP las dos colas comparten una sola proyección
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (ring->cq_ring_size > ring->sq_ring_size)
+            ring->sq_ring_size = ring->cq_ring_size;
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                         IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED)
+    {
+        ring->sq_ring = NULL;
+        goto fail;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        ring->cq_ring = ring->sq_ring;
+    }
+    else
+    {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                             IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED)
+        {
+            ring->cq_ring = NULL;
+            goto fail;
+        }
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                      IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+    {
+        ring->sqes = NULL;
+        goto fail;
+    }
+
+    char *sq = ring->sq_ring;
+    char *cq = ring->cq_ring;
+    ring->sq_head = (unsigned int *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned int *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned int *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned int *)(sq + params.sq_off.array);
+    ring->sq_entries = params.sq_entries;
+    ring->sq_local_tail = *ring->sq_tail;
+    ring->cq_head = (unsigned int *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned int *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned int *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    // Entrada i de la cola de envío = SQE i: no hace falta rellenar sq_array en cada envío
+    for (unsigned int i = 0; i < ring->sq_entries; i++)
+        ring->sq_array[i] = i;
+
+    if (!uring_supports_ops(ring))
+    {
+        syslog(LOG_ERR, "io_uring lacks accept/recv/send/read/write support");
+        goto fail;
+    }
+    return 0;
+
+fail:
+    uring_destroy(ring);
+    return -1;
+}
+
+/**
+ * Publica los SQE preparados y los entrega al kernel. Con @param wait espera
+ * además a que haya al menos un CQE.
+ * @return lo que devuelve io_uring_enter (-1 y errno en caso de error)
+ */
+static int uring_submit(uring_t *ring, bool wait)
+{
+    // Se cuentan desde sq_head: incluye los que el kernel no aceptó en la llamada anterior
+    unsigned int to_submit = ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+    __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+    if (to_submit == 0 && !wait)
+        return 0;
+    return (int)syscall(__NR_io_uring_enter, ring->fd, to_submit, wait ? 1 : 0, wait ? IORING_ENTER_GETEVENTS : 0,
+                        NULL, 0);
+}
+
+/**
+ * Garantiza @param count SQE libres seguidos, entregando antes los
+ * pendientes si hace falta. Así una pareja enlazada no queda partida
+ * entre dos io_uring_enter.
+ */
+static bool uring_reserve(uring_t *ring, unsigned int count)
+{
+    unsigned int used = ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+    if (ring->sq_entries - used >= count)
+        return true;
+    if (uring_submit(ring, false) < 0)
+        return false;
+    used = ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    return ring->sq_entries - used >= count;
+}
+
+// Prepara un SQE; llamar sólo tras uring_reserve
+static struct io_uring_sqe *uring_prep(uring_t *ring, int opcode, int fd, const void *addr, unsigned int len,
+                                       uint64_t offset, uint64_t user_data)
+{
+    struct io_uring_sqe *sqe = &ring->sqes[ring->sq_local_tail & *ring->sq_mask];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = (uint8_t)opcode;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)addr;
+    sqe->len = len;
+    sqe->off = offset;
+    sqe->user_data = user_data;
+    ring->sq_local_tail++;
+    return sqe;
+}
+
+static uint64_t uring_user_data(uring_conn_t *conn, uring_op_t op)
+{
+    return (uint64_t)(uintptr_t)conn | op;
+}
+
+static void uring_arm_accept(uring_server_t *server)
+{
+    if (server->accept_armed || exit_requested || server->outstanding >= MAX_PENDING_CONNECTIONS)
+        return;
+    if (!uring_reserve(&server->ring, 1))
+        return;
+    struct io_uring_sqe *sqe =
+        uring_prep(&server->ring, IORING_OP_ACCEPT, server->listen_fd, NULL, 0, 0, uring_user_data(NULL, URING_OP_ACCEPT));
+    sqe->accept_flags = SOCK_CLOEXEC;
+    server->accept_armed = true;
+}
+
+// Espera el siguiente vencimiento del timerfd de las marcas de tiempo
+static void uring_arm_timer(uring_server_t *server)
+{
+    if (server->timer_fd < 0 || !uring_reserve(&server->ring, 1))
+        return;
+    uring_prep(&server->ring, IORING_OP_READ, server->timer_fd, &server->timer_expirations,
+               sizeof(server->timer_expirations), 0, uring_user_data(NULL, URING_OP_TIMER));
+}
+
+static void uring_conn_recv(uring_server_t *server, uring_conn_t *conn, bool reserved)
+{
+    if (!reserved && !uring_reserve(&server->ring, 1))
+    {
+        conn->done = true;
+        return;
+    }
+    uring_prep(&server->ring, IORING_OP_RECV, conn->client_fd, conn->buf, BUFFER_SIZE, 0,
+               uring_user_data(conn, URING_OP_RECV));
+    conn->inflight++;
+}
+
+// Lee el siguiente bloque del eco; el lector y echo_buf ya están preparados
+static void uring_conn_read(uring_server_t *server, uring_conn_t *conn, bool reserved)
+{
+    if (!reserved && !uring_reserve(&server->ring, 1))
+    {
+        conn->done = true;
+        return;
+    }
+    // Lectura con offset explícito: no depende de f_pos del descriptor compartido
+    uring_prep(&server->ring, IORING_OP_READ, conn->reader.fd, conn->echo_buf, URING_ECHO_SIZE,
+               (uint64_t)conn->read_pos, uring_user_data(conn, URING_OP_READ));
+    conn->inflight++;
+}
+
+static void uring_conn_send(uring_server_t *server, uring_conn_t *conn)
+{
+    if (!uring_reserve(&server->ring, 1))
+    {
+        conn->done = true;
+        return;
+    }
+    struct io_uring_sqe *sqe = uring_prep(&server->ring, IORING_OP_SEND, conn->client_fd, conn->echo_buf + conn->send_off,
+                                          (unsigned int)(conn->send_len - conn->send_off), 0,
+                                          uring_user_data(conn, URING_OP_SEND));
+    sqe->msg_flags = MSG_NOSIGNAL;
+    conn->inflight++;
+}
+
+// Obtiene descriptor de lectura y buffer para un eco. @return false si no hay eco posible
+static bool uring_conn_start_echo(uring_conn_t *conn)
+{
+    if (!conn->echo_buf)
+        conn->echo_buf = malloc(URING_ECHO_SIZE);
+    if (!conn->echo_buf)
+        return false;
+    if (conn->reader.fd < 0 && datafile_acquire_reader(&conn->reader) < 0)
+    {
+        conn->reader.fd = -1;
+        return false;
+    }
+    return true;
+}
 
-        if (exit_requested)
-            break;
+// Fin de un eco: el descriptor vuelve a la caché hasta el siguiente paquete
+static void uring_conn_end_echo(uring_conn_t *conn)
+{
+    if (conn->reader.fd >= 0)
+        datafile_release_reader(&conn->reader, conn->reader_failed);
+    conn->reader.fd = -1;
+    conn->reader_failed = false;
+}
 
-        time_t rawtime;
-        struct tm *info;
-        char timestamp[100];
+static void uring_conn_advance(uring_server_t *server, uring_conn_t *conn);
 
-        time(&rawtime);
-        info = localtime(&rawtime);
-        // Formato RFC 2822: %a, %d %b %Y %H:%M:%S %z
-        strftime(timestamp, sizeof(timestamp), "timestamp:%a, %d %b %Y %H:%M:%S %z\n", info);
+// Eco con memstore: se copia entero a echo_buf y sólo hace falta enviarlo
+static void uring_conn_memstore_echo(uring_server_t *server, uring_conn_t *conn, const struct aesd_seekto *seekto)
+{
+    ssize_t len = memstore_snapshot(seekto, &conn->echo_buf, &conn->echo_size);
 
-        pthread_mutex_lock(&file_mutex);
-        FILE *fp = fopen(DATAFILE, "a+");
-        if (fp)
-        {
-            fputs(timestamp, fp);
-            fclose(fp);
-        }
-        pthread_mutex_unlock(&file_mutex);
+    if (len <= 0)
+    {
+        if (len < 0)
+            syslog(LOG_ERR, "Seek in %s failed: %s", datafile_path, strerror(errno));
+        uring_conn_advance(server, conn);
+        return;
     }
-    return NULL;
+    conn->echo_snapshot = true;
+    conn->send_off = 0;
+    conn->send_len = (size_t)len;
+    uring_conn_send(server, conn);
 }
 
-void *handle_connection(void *arg)
+// Comando AESDCHAR_IOCSEEKTO: ioctl síncrono y eco desde la posición resultante
+static void uring_conn_seekto(uring_server_t *server, uring_conn_t *conn)
 {
-    thread_data_t *data = (thread_data_t *)arg;
-    char client_ip[INET_ADDRSTRLEN];
-    char *recv_buf = malloc(BUFFER_SIZE);
-    char *send_buf = malloc(BUFFER_SIZE);
-
-    inet_ntop(AF_INET, &data->client_addr.sin_addr, client_ip, sizeof(client_ip));
+    struct aesd_seekto seekto = {.write_cmd = conn->framer.write_cmd,
+                                 .write_cmd_offset = conn->framer.write_cmd_offset};
 
-    // El archivo debe abrirse y cerrarse dentro del hilo o manejarse con cuidado
-    // Usaremos fopen/fclose dentro de la sección crítica para asegurar consistencia
+    if (datafile.store == DATAFILE_STORE_MMAP)
+    {
+        uring_conn_memstore_echo(server, conn, &seekto);
+        return;
+    }
+    if (!uring_conn_start_echo(conn))
+    {
+        uring_conn_advance(server, conn);
+        return;
+    }
+    if (ioctl(conn->reader.fd, AESDCHAR_IOCSEEKTO, &seekto) != 0)
+    {
+        syslog(LOG_ERR, "ioctl failed: %s", strerror(errno));
+        conn->reader_failed = datafile_error_is_stale(errno);
+        uring_conn_end_echo(conn);
+        uring_conn_advance(server, conn);
+        return;
+    }
+    conn->read_pos = lseek(conn->reader.fd, 0, SEEK_CUR);
+    if (conn->read_pos < 0)
+    {
+        uring_conn_end_echo(conn);
+        uring_conn_advance(server, conn);
+        return;
+    }
+    uring_conn_read(server, conn, false);
+}
 
-    ssize_t bytes_received;
-    bool newline_found = false;
-    bool is_ioctl_command = false;
-    uint32_t write_cmd = 0, write_cmd_offset = 0;
+/**
+ * Sigue con el trozo recibido hasta que haya que esperar a una operación:
+ * el write de un fragmento, el eco de un paquete o el siguiente recv.
+ */
+static void uring_conn_advance(uring_server_t *server, uring_conn_t *conn)
+{
+    const char *frame;
+    size_t frame_len;
+    frame_kind_t kind = framer_next(&conn->framer, &frame, &frame_len);
 
-    syslog(LOG_INFO, "Starting receive loop for client from %s", client_ip);
-    while (!exit_requested && (bytes_received = recv(data->client_fd, recv_buf, BUFFER_SIZE, 0)) > 0)
+    if (kind == FRAME_NONE)
     {
-        syslog(LOG_INFO, "Recv returned: %zd", bytes_received);
-
-        // Check if this is an AESDCHAR_IOCSEEKTO command
-        syslog(LOG_INFO, "Received %zd bytes: %.*s", bytes_received, (int)bytes_received, recv_buf);
-        if (bytes_received > 0 && strncmp(recv_buf, "AESDCHAR_IOCSEEKTO:", 19) == 0)
+        uring_conn_recv(server, conn, false);
+        return;
+    }
+    if (kind == FRAME_SEEKTO)
+    {
+        uring_conn_seekto(server, conn);
+        return;
+    }
+    if (datafile.store == DATAFILE_STORE_MMAP)
+    {
+        // Añadir a memstore es una copia en memoria: no pasa por el anillo
+        if (datafile_writer_write(&conn->writer, frame, frame_len) < 0)
         {
-            // Parse X,Y from the command
-            char *cmd_params = recv_buf + 19; // Skip "AESDCHAR_IOCSEEKTO:"
-            int parsed = sscanf(cmd_params, "%u,%u", &write_cmd, &write_cmd_offset);
-            syslog(LOG_INFO, "Parsed ioctl: write_cmd=%u, write_cmd_offset=%u, result=%d", write_cmd, write_cmd_offset, parsed);
-            if (parsed == 2)
-            {
-                is_ioctl_command = true;
-                newline_found = true;
-                syslog(LOG_INFO, "AESDCHAR_IOCSEEKTO command detected: cmd=%u offset=%u", write_cmd, write_cmd_offset);
-                break;
-            }
+            conn->write_failed = true;
+            conn->done = true;
         }
-
-        pthread_mutex_lock(&file_mutex);
-        FILE *fp = fopen(DATAFILE, "a+");
-        if (!fp)
+        else if (kind == FRAME_PACKET)
         {
-            syslog(LOG_ERR, "File open failed: %s", strerror(errno));
-            close(data->client_fd);
-            continue;
+            uring_conn_memstore_echo(server, conn, NULL);
         }
-        if (fp)
+        else
         {
-            fwrite(recv_buf, 1, bytes_received, fp);
-            fclose(fp);
+            uring_conn_advance(server, conn);
         }
-        pthread_mutex_unlock(&file_mutex);
+        return;
+    }
 
-        if (memchr(recv_buf, '\n', bytes_received))
-        {
-            newline_found = true;
-            break;
-        }
+    if (datafile_writer_open(&conn->writer) < 0)
+    {
+        conn->write_failed = true;
+        conn->done = true;
+        return;
+    }
+    // Todo lo que puede fallar va antes de preparar la pareja enlazada
+    bool echo = kind == FRAME_PACKET && uring_conn_start_echo(conn);
+    // Si el trozo se consume entero, el write puede ir enlazado con el siguiente recv
+    bool recv_next = kind == FRAME_DATA && conn->framer.in_len == 0;
+    if (!uring_reserve(&server->ring, 2))
+    {
+        conn->done = true;
+        return;
     }
 
-    if (newline_found)
+    // O_APPEND: el offset se ignora en ficheros normales y el driver siempre añade
+    struct io_uring_sqe *sqe = uring_prep(&server->ring, IORING_OP_WRITE, conn->writer.fd, frame,
+                                          (unsigned int)frame_len, 0, uring_user_data(conn, URING_OP_WRITE));
+    conn->write_len = frame_len;
+    conn->write_newline = kind == FRAME_PACKET;
+    conn->write_linked = echo || recv_next;
+    conn->inflight++;
+
+    if (echo)
     {
-        syslog(LOG_INFO, "Newline found, is_ioctl_command=%d", is_ioctl_command);
-        if (is_ioctl_command)
-        {
-            // Handle AESDCHAR_IOCSEEKTO command
-            syslog(LOG_INFO, "Processing AESDCHAR_IOCSEEKTO: cmd=%u, offset=%u", write_cmd, write_cmd_offset);
-            pthread_mutex_lock(&file_mutex);
+        sqe->flags |= IOSQE_IO_LINK;
+        conn->read_pos = 0;
+        uring_conn_read(server, conn, true);
+    }
+    else if (recv_next)
+    {
+        sqe->flags |= IOSQE_IO_LINK;
+        uring_conn_recv(server, conn, true);
+    }
+}
 
-            // Open device file with file descriptor (not FILE*)
-            int fd = open(DATAFILE, O_RDWR);
-            if (fd < 0)
-            {
-                syslog(LOG_ERR, "Failed to open device for ioctl: %s", strerror(errno));
-                pthread_mutex_unlock(&file_mutex);
-            }
-            else
-            {
-                syslog(LOG_INFO, "Device opened successfully, fd=%d", fd);
-
-                // Prepare ioctl structure
-                struct aesd_seekto seekto;
-                seekto.write_cmd = write_cmd;
-                seekto.write_cmd_offset = write_cmd_offset;
-
-                // Perform ioctl
-                int ret = ioctl(fd, AESDCHAR_IOCSEEKTO, &seekto);
-                syslog(LOG_INFO, "ioctl returned: %d", ret);
-                if (ret != 0)
-                {
-                    syslog(LOG_ERR, "ioctl failed with error %d: %s", ret, strerror(errno));
-                }
-                else
-                {
-                    syslog(LOG_INFO, "ioctl succeeded, reading from device");
-                    // Read from the same file descriptor after ioctl
-                    ssize_t bytes_read;
-                    while ((bytes_read = read(fd, send_buf, BUFFER_SIZE)) > 0)
-                    {
-                        syslog(LOG_INFO, "Read %zd bytes from device", bytes_read);
-                        send(data->client_fd, send_buf, bytes_read, 0);
-                    }
-                }
-
-                close(fd);
-                pthread_mutex_unlock(&file_mutex);
-            }
-        }
-        else
-        {
-            // Normal case: read entire file and send back
-            pthread_mutex_lock(&file_mutex);
-            FILE *fp = fopen(DATAFILE, "r");
-            if (fp)
-            {
-                size_t bytes_read;
-                while ((bytes_read = fread(send_buf, 1, BUFFER_SIZE, fp)) > 0)
-                {
-                    send(data->client_fd, send_buf, bytes_read, 0);
-                }
-                fclose(fp);
-            }
-            pthread_mutex_unlock(&file_mutex);
-        }
+static void uring_on_recv(uring_server_t *server, uring_conn_t *conn, int res)
+{
+    // EOF o error: se cierra; un paquete sin '\n' lo descarta el driver al cerrar el descriptor
+    if (res <= 0)
+    {
+        conn->done = true;
+        return;
     }
+    framer_feed(&conn->framer, conn->buf, (size_t)res);
+    uring_conn_advance(server, conn);
+}
 
-    close(data->client_fd);
-    syslog(LOG_INFO, "Closed connection from %s", client_ip);
+static void uring_on_write(uring_server_t *server, uring_conn_t *conn, int res)
+{
+    if (res < 0 || (size_t)res != conn->write_len)
+    {
+        // Un write corto también rompe el enlace: el kernel cancela la operación siguiente
+        syslog(LOG_ERR, "Write to %s failed: %s", datafile_path, res < 0 ? strerror(-res) : "short write");
+        conn->write_failed = true;
+        conn->done = true;
+        return;
+    }
+    conn->writer.written = true;
+    conn->writer.partial = !conn->write_newline;
+    if (!conn->write_linked)
+        uring_conn_advance(server, conn);
+}
 
-    free(recv_buf);
-    free(send_buf);
-    data->completed = true;
-    return arg;
+static void uring_on_read(uring_server_t *server, uring_conn_t *conn, int res)
+{
+    if (res < 0)
+    {
+        // -ECANCELED: el write enlazado falló
+        if (res != -ECANCELED)
+            conn->reader_failed = true;
+        conn->done = true;
+        return;
+    }
+    if (res == 0)
+    {
+        // Eco completo: siguiente paquete del mismo trozo o siguiente recv
+        uring_conn_end_echo(conn);
+        uring_conn_advance(server, conn);
+        return;
+    }
+    conn->read_pos += res;
+    conn->send_off = 0;
+    conn->send_len = (size_t)res;
+    uring_conn_send(server, conn);
 }
 
-int main(int argc, char *argv[])
+static void uring_on_send(uring_server_t *server, uring_conn_t *conn, int res)
 {
-    bool daemon_mode = (argc > 1 && strcmp(argv[1], "-d") == 0);
+    if (res < 0)
+    {
+        conn->done = true;
+        return;
+    }
+    conn->send_off += (size_t)res;
+    if (conn->send_off < conn->send_len)
+    {
+        uring_conn_send(server, conn);
+    }
+    else if (conn->echo_snapshot)
+    {
+        conn->echo_snapshot = false;
+        uring_conn_advance(server, conn);
+    }
+    else
+    {
+        uring_conn_read(server, conn, false);
+    }
+}
 
-    if (daemon_mode)
+static void uring_conn_close(uring_server_t *server, uring_conn_t *conn)
+{
+    datafile_writer_release(&conn->writer, conn->write_failed);
+    if (conn->reader.fd >= 0)
+        datafile_release_reader(&conn->reader, conn->reader_failed);
+    close(conn->client_fd);
+    free(conn->echo_buf);
+
+    if (conn->prev)
+        conn->prev->next = conn->next;
+    else
+        server->conns = conn->next;
+    if (conn->next)
+        conn->next->prev = conn->prev;
+    free(conn);
+    server->outstanding--;
+}
+
+static void uring_on_accept(uring_server_t *server, int res)
+{
+    server->accept_armed = false;
+    if (res < 0)
     {
-        pid_t pid = fork();
-        if (pid < 0)
-            exit(-1);
-        if (pid > 0)
-            exit(0);
-        setsid();
-        chdir("/");
-        int devnull = open("/dev/null", O_RDWR);
-        dup2(devnull, STDIN_FILENO);
-        dup2(devnull, STDOUT_FILENO);
-        dup2(devnull, STDERR_FILENO);
+        if (res != -EINTR && res != -ECANCELED)
+            syslog(LOG_ERR, "Accept failed: %s", strerror(-res));
+        return;
     }
 
-    struct sigaction sa = {.sa_handler = signal_handler};
-    sigaction(SIGINT, &sa, NULL);
-    sigaction(SIGTERM, &sa, NULL);
+    uring_conn_t *conn = malloc(sizeof(*conn));
+    if (!conn)
+    {
+        close(res);
+        return;
+    }
+    memset(conn, 0, offsetof(uring_conn_t, buf));
+    conn->client_fd = res;
+    conn->writer = (datafile_writer_t)DATAFILE_WRITER_INIT;
+    conn->reader.fd = -1;
+    framer_init(&conn->framer);
+    conn->next = server->conns;
+    if (server->conns)
+        server->conns->prev = conn;
+    server->conns = conn;
+    server->outstanding++;
 
-    openlog("aesdsocket", LOG_PID, LOG_USER);
+    uring_conn_recv(server, conn, false);
+    if (conn->done && conn->inflight == 0)
+        uring_conn_close(server, conn);
+}
 
-    int server_fd = socket(AF_INET, SOCK_STREAM, 0);
-    int opt = 1;
-    setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+static void uring_dispatch(uring_server_t *server, const struct io_uring_cqe *cqe)
+{
+    uring_conn_t *conn = (uring_conn_t *)(uintptr_t)(cqe->user_data & ~(uint64_t)URING_OP_MASK);
+    uring_op_t op = (uring_op_t)(cqe->user_data & URING_OP_MASK);
 
-    struct sockaddr_in server_address = {
-        .sin_family = AF_INET,
-        .sin_addr.s_addr = htonl(INADDR_ANY),
-        .sin_port = htons(PORT)};
+    if (op == URING_OP_ACCEPT)
+    {
+        uring_on_accept(server, cqe->res);
+        return;
+    }
+    if (op == URING_OP_TIMER)
+    {
+        if (cqe->res == (int)sizeof(server->timer_expirations))
+            timestamp_write();
+        uring_arm_timer(server);
+        return;
+    }
 
-    if (bind(server_fd, (struct sockaddr *)&server_address, sizeof(server_address)) < 0)
+    conn->inflight--;
+    // Tras un fallo sólo se esperan los CQE pendientes (p.ej. -ECANCELED del enlace)
+    if (!conn->done)
     {
-        syslog(LOG_ERR, "Bind failed: %s", strerror(errno));
-        close(server_fd);
+        switch (op)
+        {
+        case URING_OP_RECV:
+            uring_on_recv(server, conn, cqe->res);
+            break;
+        case URING_OP_WRITE:
+            uring_on_write(server, conn, cqe->res);
+            break;
+        case URING_OP_READ:
+            uring_on_read(server, conn, cqe->res);
+            break;
+        case URING_OP_SEND:
+            uring_on_send(server, conn, cqe->res);
+            break;
+        default:
+            break;
+        }
+    }
+    if (conn->done && conn->inflight == 0)
+        uring_conn_close(server, conn);
+}
+
+/**
+ * Atiende las conexiones con io_uring hasta que se pida salir.
+ * @return 0 al terminar, -1 si io_uring no está disponible (no se ha
+ *      aceptado ninguna conexión y el llamante puede usar otro modo)
+ */
+static int run_uring_loop(int server_fd, int timer_fd)
+{
+    uring_server_t server = {.listen_fd = server_fd, .timer_fd = timer_fd};
+
+    if (uring_init(&server.ring) < 0)
         return -1;
+    syslog(LOG_INFO, "Using io_uring backend");
+
+    uring_arm_accept(&server);
+    uring_arm_timer(&server);
+    while (!exit_requested)
+    {
+        if (uring_submit(&server.ring, true) < 0)
+        {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+                continue;
+            syslog(LOG_ERR, "io_uring_enter failed: %s", strerror(errno));
+            break;
+        }
+
+        unsigned int head = *server.ring.cq_head;
+        unsigned int tail = __atomic_load_n(server.ring.cq_tail, __ATOMIC_ACQUIRE);
+        while (head != tail)
+        {
+            struct io_uring_cqe cqe = server.ring.cqes[head & *server.ring.cq_mask];
+
+            head++;
+            // Se libera la entrada antes de procesarla: el proceso puede enviar y esperar
+            __atomic_store_n(server.ring.cq_head, head, __ATOMIC_RELEASE);
+            uring_dispatch(&server, &cqe);
+        }
+        uring_arm_accept(&server);
     }
-    if (listen(server_fd, BACKLOG) < 0)
+
+    // Las operaciones en vuelo mantienen vivos sus sockets hasta que el kernel
+    // desmonta el anillo: shutdown libera ya el puerto para un reinicio inmediato
+    shutdown(server_fd, SHUT_RDWR);
+    for (uring_conn_t *conn = server.conns; conn; conn = conn->next)
+        shutdown(conn->client_fd, SHUT_RDWR);
+    // Cerrar el anillo cancela las operaciones en vuelo antes de liberar sus buffers
+    uring_destroy(&server.ring);
+    while (server.conns)
     {
-        syslog(LOG_ERR, "Listen failed: %s", strerror(errno));
-        close(server_fd);
-        return -1;
+        server.conns->write_failed = true;
+        uring_conn_close(&server, server.conns);
     }
+    return 0;
+}
+
+#else
+
+static int run_uring_loop(int server_fd, int timer_fd)
+{
+    (void)server_fd;
+    (void)timer_fd;
+    syslog(LOG_ERR, "aesdsocket built without io_uring support");
+    return -1;
+}
 
-    // LANZAR EL HILO DEL TEMPORIZADOR
-    pthread_t timer_tid;
-    pthread_create(&timer_tid, NULL, timer_thread, NULL);
+#endif // HAVE_IO_URING
 
+static int run_thread_per_connection(int server_fd)
+{
     thread_data_t *head = NULL;
 
     while (!exit_requested)
@@ -273,8 +2247,13 @@ int main(int argc, char *argv[])
 
         if (client_fd < 0)
         {
-            if (errno == EINTR && exit_requested)
-                break;
+            if (errno == EINTR)
+            {
+                if (exit_requested)
+                    break;
+                // Otra señal (SIGHUP): el socket de escucha sigue siendo válido
+                continue;
+            }
             syslog(LOG_ERR, "Accept failed: %s", strerror(errno));
             close(server_fd);
 
@@ -287,9 +2266,7 @@ int main(int argc, char *argv[])
 
         // Crear nodo para el nuevo hilo
         thread_data_t *new_thread = malloc(sizeof(thread_data_t));
-        new_thread->client_fd = client_fd;
-        new_thread->client_addr = client_addr;
-        new_thread->completed = false;
+        connection_init(new_thread, client_fd, &client_addr);
         new_thread->next = head;
         head = new_thread;
 
@@ -322,16 +2299,15 @@ int main(int argc, char *argv[])
     }
 
     /* Cleanup */
-    while (head)
+    // Un cliente persistente inactivo deja su hilo en recv(): shutdown lo despierta
+    pthread_mutex_lock(&thread_list_lock);
+    for (thread_data_t *curr = head; curr; curr = curr->next)
     {
-        pthread_join(head->thread_id, NULL);
-        thread_data_t *temp = head;
-        head = head->next;
-        free(temp);
+        if (!curr->completed)
+            shutdown(curr->client_fd, SHUT_RDWR);
     }
+    pthread_mutex_unlock(&thread_list_lock);
 
-    // Limpieza final
-    pthread_join(timer_tid, NULL);
     while (head)
     {
         pthread_join(head->thread_id, NULL);
@@ -339,10 +2315,172 @@ int main(int argc, char *argv[])
         head = head->next;
         free(temp);
     }
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    bool daemon_mode = false;
+    bool epoll_mode = false;
+    bool uring_mode = false;
+    bool datafile_given = false;
+    size_t store_max_entries = STORE_MAX_ENTRIES;
+    size_t store_max_bytes = STORE_MAX_BYTES;
+    unsigned int timestamp_interval = TIMESTAMP_INTERVAL_SEC;
+    int opt_char;
+
+    while ((opt_char = getopt(argc, argv, "def:n:s:t:uz:")) != -1)
+    {
+        switch (opt_char)
+        {
+        case 'd':
+            daemon_mode = true;
+            break;
+        case 'e':
+            epoll_mode = true;
+            break;
+        case 'f':
+            datafile_path = optarg;
+            datafile_given = true;
+            break;
+        case 'n':
+            store_max_entries = strtoul(optarg, NULL, 10);
+            break;
+        case 's':
+            if (strcmp(optarg, "mmap") == 0)
+                datafile.store = DATAFILE_STORE_MMAP;
+            else if (strcmp(optarg, "dev") == 0)
+                datafile.store = DATAFILE_STORE_DEVICE;
+            else
+            {
+                fprintf(stderr, "Unknown store %s, expected dev or mmap\n", optarg);
+                return -1;
+            }
+            break;
+        case 't':
+        {
+            char *end;
+            unsigned long interval;
+
+            // 0 desactiva las marcas de tiempo; strtoul aceptaría "", "-1" o "5s"
+            errno = 0;
+            interval = strtoul(optarg, &end, 10);
+            if (!isdigit((unsigned char)optarg[0]) || *end != '\0' || errno == ERANGE || interval > UINT_MAX)
+            {
+                fprintf(stderr, "Invalid timestamp interval %s, expected whole seconds\n", optarg);
+                return -1;
+            }
+            timestamp_interval = (unsigned int)interval;
+            break;
+        }
+        case 'u':
+            uring_mode = true;
+            break;
+        case 'z':
+            store_max_bytes = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            fprintf(stderr,
+                    "Usage: %s [-d] [-e] [-u] [-f datafile] [-t timestamp_seconds]\n"
+                    "       [-s dev|mmap] [-n max_commands] [-z max_bytes]\n"
+                    "  -s mmap keeps the history in-process; -f is then a ring of -z bytes\n"
+                    "  (default " STOREFILE "), truncated at start and removed at exit\n",
+                    argv[0]);
+            return -1;
+        }
+    }
+    // El almacén en proceso no usa el dispositivo por defecto
+    if (datafile.store == DATAFILE_STORE_MMAP && !datafile_given)
+        datafile_path = STOREFILE;
+
+    if (daemon_mode)
+    {
+        pid_t pid = fork();
+        if (pid < 0)
+            exit(-1);
+        if (pid > 0)
+            exit(0);
+        setsid();
+        chdir("/");
+        int devnull = open("/dev/null", O_RDWR);
+        dup2(devnull, STDIN_FILENO);
+        dup2(devnull, STDOUT_FILENO);
+        dup2(devnull, STDERR_FILENO);
+    }
+
+    struct sigaction sa = {.sa_handler = signal_handler};
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    // SA_RESTART: la reapertura no debe interrumpir accept() ni recv() en curso
+    struct sigaction sa_hup = {.sa_handler = reopen_handler, .sa_flags = SA_RESTART};
+    sigaction(SIGHUP, &sa_hup, NULL);
+    // sendfile no admite MSG_NOSIGNAL: un cliente que cierra a mitad del eco daría SIGPIPE
+    struct sigaction sa_pipe = {.sa_handler = SIG_IGN};
+    sigaction(SIGPIPE, &sa_pipe, NULL);
+
+    openlog("aesdsocket", LOG_PID, LOG_USER);
+
+    int server_fd = socket(AF_INET, SOCK_STREAM, 0);
+    int opt = 1;
+    setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+    struct sockaddr_in server_address = {
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = htonl(INADDR_ANY),
+        .sin_port = htons(PORT)};
+
+    if (bind(server_fd, (struct sockaddr *)&server_address, sizeof(server_address)) < 0)
+    {
+        syslog(LOG_ERR, "Bind failed: %s", strerror(errno));
+        close(server_fd);
+        return -1;
+    }
+    if (listen(server_fd, epoll_mode || uring_mode ? SOMAXCONN : BACKLOG) < 0)
+    {
+        syslog(LOG_ERR, "Listen failed: %s", strerror(errno));
+        close(server_fd);
+        return -1;
+    }
+
+    if (datafile.store == DATAFILE_STORE_MMAP &&
+        (store_max_entries == 0 || store_max_bytes == 0 || memstore_open(store_max_entries, store_max_bytes) < 0))
+    {
+        syslog(LOG_ERR, "Cannot create the in-process store in %s", datafile_path);
+        close(server_fd);
+        return -1;
+    }
+
+    int timer_fd = timestamp_interval ? timestamp_timer_create(timestamp_interval) : -1;
+
+    // -u recurre a -e o a un hilo por conexión si el kernel no soporta io_uring
+    if (!uring_mode || run_uring_loop(server_fd, timer_fd) < 0)
+    {
+        if (epoll_mode)
+        {
+            run_event_loop(server_fd, timer_fd);
+        }
+        else
+        {
+            pthread_t timer_tid;
+            bool timer_started = timer_fd >= 0 && pthread_create(&timer_tid, NULL, timer_thread, &timer_fd) == 0;
+
+            run_thread_per_connection(server_fd);
+            if (timer_started)
+            {
+                timestamp_timer_wake(timer_fd);
+                pthread_join(timer_tid, NULL);
+            }
+        }
+    }
 
+    // Limpieza final
+    if (timer_fd >= 0)
+        close(timer_fd);
     close(server_fd);
-    remove(DATAFILE);
-    pthread_mutex_destroy(&file_mutex);
+    datafile_close_all();
+    if (datafile.store == DATAFILE_STORE_MMAP)
+        memstore_close();
+    remove(datafile_path);
     closelog();
     return 0;
 }
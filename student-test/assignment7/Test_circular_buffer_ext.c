@@ -0,0 +1,188 @@
+#include "unity.h"
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../../aesd-char-driver/aesd-circular-buffer.h"
+
+/**
+ * Tests for the parts of aesd-circular-buffer.c added on top of the assignment 7 interface:
+ * resizing, the arena and the (entry, offset) -> char offset lookup used by AESDCHAR_IOCSEEKTO.
+ */
+
+static void add_string(struct aesd_circular_buffer *buffer, const char *str)
+{
+    struct aesd_buffer_entry entry;
+
+    entry.buffptr = str;
+    entry.size = strlen(str);
+    aesd_circular_buffer_add_entry(buffer, &entry);
+}
+
+// Comprueba que char_offset cae en la entrada con el texto expected, en el byte expected_offset
+static void assert_fpos(struct aesd_circular_buffer *buffer, size_t char_offset, const char *expected,
+                        size_t expected_offset)
+{
+    size_t offset_rtn;
+    struct aesd_buffer_entry *entry =
+        aesd_circular_buffer_find_entry_offset_for_fpos(buffer, char_offset, &offset_rtn);
+
+    TEST_ASSERT_NOT_NULL_MESSAGE(entry, "Expected an entry for this char offset");
+    TEST_ASSERT_EQUAL_PTR_MESSAGE(expected, entry->buffptr, "Wrong entry for this char offset");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(expected_offset, offset_rtn, "Wrong byte offset within the entry");
+}
+
+void test_circular_buffer_find_fpos_for_entry()
+{
+    struct aesd_circular_buffer buffer;
+    struct aesd_buffer_entry *entry;
+    static const char *strings[] = {"w0\n", "w1 longer\n", "w2\n", "w3\n", "w4\n", "w5\n",
+                                    "w6\n", "w7\n", "w8\n", "w9\n", "w10\n", "w11\n"};
+    size_t char_offset = 0;
+    size_t i;
+
+    aesd_circular_buffer_init(&buffer);
+    add_string(&buffer, strings[0]);
+    add_string(&buffer, strings[1]);
+    add_string(&buffer, strings[2]);
+
+    entry = aesd_circular_buffer_find_fpos_for_entry(&buffer, 1, 3, &char_offset);
+    TEST_ASSERT_EQUAL_PTR(strings[1], entry->buffptr);
+    TEST_ASSERT_EQUAL_INT(3 + 3, char_offset);
+
+    entry = aesd_circular_buffer_find_fpos_for_entry(&buffer, 2, 0, &char_offset);
+    TEST_ASSERT_EQUAL_PTR(strings[2], entry->buffptr);
+    TEST_ASSERT_EQUAL_INT(3 + 10, char_offset);
+
+    // Comando inexistente y offset fuera del comando
+    char_offset = 99;
+    TEST_ASSERT_NULL(aesd_circular_buffer_find_fpos_for_entry(&buffer, 3, 0, &char_offset));
+    TEST_ASSERT_NULL(aesd_circular_buffer_find_fpos_for_entry(&buffer, 0, 3, &char_offset));
+    TEST_ASSERT_EQUAL_INT_MESSAGE(99, char_offset, "char_offset must only be set on success");
+
+    // Tras dar la vuelta, el comando 0 es el más antiguo que queda y los offsets parten de él
+    for (i = 3; i < 12; i++)
+        add_string(&buffer, strings[i]);
+    entry = aesd_circular_buffer_find_fpos_for_entry(&buffer, 0, 1, &char_offset);
+    TEST_ASSERT_EQUAL_PTR(strings[2], entry->buffptr);
+    TEST_ASSERT_EQUAL_INT(1, char_offset);
+    entry = aesd_circular_buffer_find_fpos_for_entry(&buffer, 9, 2, &char_offset);
+    TEST_ASSERT_EQUAL_PTR(strings[11], entry->buffptr);
+    TEST_ASSERT_EQUAL_INT(8 * 3 + 4 + 2, char_offset);
+    assert_fpos(&buffer, char_offset, strings[11], 2);
+    TEST_ASSERT_NULL(aesd_circular_buffer_find_fpos_for_entry(&buffer, 10, 0, &char_offset));
+}
+
+void test_circular_buffer_resize()
+{
+    struct aesd_circular_buffer buffer;
+    struct aesd_buffer_entry *grown = calloc(16, sizeof(*grown));
+    struct aesd_buffer_entry *shrunk = calloc(4, sizeof(*shrunk));
+    struct aesd_buffer_entry *old_entries = grown;
+    struct aesd_buffer_entry removed;
+    static const char *strings[] = {"r0\n", "r1\n", "r2\n", "r3\n", "r4\n", "r5\n",
+                                    "r6\n", "r7\n", "r8\n", "r9\n", "r10\n", "r11\n"};
+    size_t i;
+
+    TEST_ASSERT_NOT_NULL(grown);
+    TEST_ASSERT_NOT_NULL(shrunk);
+    aesd_circular_buffer_init(&buffer);
+    // Lleno y con out_offs a mitad del array embebido
+    for (i = 0; i < 12; i++)
+        add_string(&buffer, strings[i]);
+
+    TEST_ASSERT_TRUE(aesd_circular_buffer_resize(&buffer, grown, 16, &old_entries));
+    TEST_ASSERT_NULL_MESSAGE(old_entries, "The embedded storage must not be returned for release");
+    TEST_ASSERT_EQUAL_INT(10, aesd_circular_buffer_count(&buffer));
+    TEST_ASSERT_EQUAL_INT(8 * 3 + 2 * 4, aesd_circular_buffer_size(&buffer));
+    assert_fpos(&buffer, 0, strings[2], 0);
+    assert_fpos(&buffer, 8 * 3 + 1, strings[10], 1);
+
+    // Ya no se descarta nada hasta llenar las 16 entradas
+    for (i = 0; i < 6; i++)
+        add_string(&buffer, strings[i]);
+    TEST_ASSERT_EQUAL_INT(16, aesd_circular_buffer_count(&buffer));
+    assert_fpos(&buffer, 0, strings[2], 0);
+    add_string(&buffer, strings[6]);
+    assert_fpos(&buffer, 0, strings[3], 0);
+
+    // No cabe: el buffer queda como estaba
+    old_entries = shrunk;
+    TEST_ASSERT_FALSE(aesd_circular_buffer_resize(&buffer, shrunk, 4, &old_entries));
+    TEST_ASSERT_EQUAL_PTR(shrunk, old_entries);
+    TEST_ASSERT_EQUAL_INT(16, aesd_circular_buffer_count(&buffer));
+
+    while (aesd_circular_buffer_count(&buffer) > 4)
+        TEST_ASSERT_TRUE(aesd_circular_buffer_remove_oldest(&buffer, &removed));
+    TEST_ASSERT_EQUAL_PTR(strings[2], removed.buffptr);
+    TEST_ASSERT_TRUE(aesd_circular_buffer_resize(&buffer, shrunk, 4, &old_entries));
+    TEST_ASSERT_EQUAL_PTR(grown, old_entries);
+    assert_fpos(&buffer, 0, strings[3], 0);
+    assert_fpos(&buffer, 3 * 3 + 2, strings[6], 2);
+
+    // Capacidad no válida
+    TEST_ASSERT_FALSE(aesd_circular_buffer_resize(&buffer, grown, 0, &old_entries));
+    TEST_ASSERT_FALSE(aesd_circular_buffer_resize(&buffer, grown, AESDCHAR_MAX_CAPACITY + 1, &old_entries));
+
+    free(grown);
+    free(shrunk);
+}
+
+void test_circular_buffer_arena_spans()
+{
+    struct aesd_circular_buffer buffer;
+    char arena[16];
+    const char *span_ptr[2];
+    size_t span_len[2];
+    size_t evicted;
+
+    aesd_circular_buffer_init(&buffer);
+    TEST_ASSERT_FALSE(aesd_circular_buffer_add_entry_arena(&buffer, "a\n", 2, NULL));
+    TEST_ASSERT_TRUE(aesd_circular_buffer_set_arena(&buffer, arena, sizeof(arena)));
+
+    TEST_ASSERT_TRUE(aesd_circular_buffer_add_entry_arena(&buffer, "aaaa\n", 5, &evicted));
+    TEST_ASSERT_TRUE(aesd_circular_buffer_add_entry_arena(&buffer, "bbbb\n", 5, &evicted));
+    TEST_ASSERT_TRUE(aesd_circular_buffer_add_entry_arena(&buffer, "cccc\n", 5, &evicted));
+    TEST_ASSERT_EQUAL_INT(0, evicted);
+
+    // Sin salto: un solo tramo, recortado al final del historial
+    TEST_ASSERT_EQUAL_INT(1, aesd_circular_buffer_arena_spans(&buffer, 3, 100, span_ptr, span_len));
+    TEST_ASSERT_EQUAL_PTR(arena + 3, span_ptr[0]);
+    TEST_ASSERT_EQUAL_INT(12, span_len[0]);
+
+    // Sólo queda un byte al final del arena: "dd\n" empieza de nuevo en 0 y expulsa "aaaa\n"
+    TEST_ASSERT_TRUE(aesd_circular_buffer_add_entry_arena(&buffer, "dd\n", 3, &evicted));
+    TEST_ASSERT_EQUAL_INT(1, evicted);
+    TEST_ASSERT_EQUAL_INT(3, aesd_circular_buffer_count(&buffer));
+    TEST_ASSERT_EQUAL_INT(13, aesd_circular_buffer_size(&buffer));
+    TEST_ASSERT_EQUAL_MEMORY("dd\n", arena, 3);
+
+    // El historial entero ocupa dos tramos: del más antiguo al final usado y el principio del arena
+    TEST_ASSERT_EQUAL_INT(2, aesd_circular_buffer_arena_spans(&buffer, 0, 13, span_ptr, span_len));
+    TEST_ASSERT_EQUAL_PTR(arena + 5, span_ptr[0]);
+    TEST_ASSERT_EQUAL_INT(10, span_len[0]);
+    TEST_ASSERT_EQUAL_PTR(arena, span_ptr[1]);
+    TEST_ASSERT_EQUAL_INT(3, span_len[1]);
+
+    // Rangos que no cruzan el salto
+    TEST_ASSERT_EQUAL_INT(1, aesd_circular_buffer_arena_spans(&buffer, 2, 4, span_ptr, span_len));
+    TEST_ASSERT_EQUAL_PTR(arena + 7, span_ptr[0]);
+    TEST_ASSERT_EQUAL_INT(4, span_len[0]);
+    TEST_ASSERT_EQUAL_INT(1, aesd_circular_buffer_arena_spans(&buffer, 11, 5, span_ptr, span_len));
+    TEST_ASSERT_EQUAL_PTR(arena + 1, span_ptr[0]);
+    TEST_ASSERT_EQUAL_INT(2, span_len[0]);
+
+    // Fuera del historial o sin bytes pedidos
+    TEST_ASSERT_EQUAL_INT(0, aesd_circular_buffer_arena_spans(&buffer, 13, 1, span_ptr, span_len));
+    TEST_ASSERT_EQUAL_INT(0, aesd_circular_buffer_arena_spans(&buffer, 0, 0, span_ptr, span_len));
+
+    // Mayor que el arena: se rechaza sin tocar el historial
+    TEST_ASSERT_FALSE(aesd_circular_buffer_add_entry_arena(&buffer, "0123456789abcdefg", 17, &evicted));
+    TEST_ASSERT_EQUAL_INT(13, aesd_circular_buffer_size(&buffer));
+
+    // Un comando que ocupa todo el arena expulsa al resto
+    TEST_ASSERT_TRUE(aesd_circular_buffer_add_entry_arena(&buffer, "0123456789abcde\n", 16, &evicted));
+    TEST_ASSERT_EQUAL_INT(3, evicted);
+    TEST_ASSERT_EQUAL_INT(1, aesd_circular_buffer_arena_spans(&buffer, 0, 16, span_ptr, span_len));
+    TEST_ASSERT_EQUAL_PTR(arena, span_ptr[0]);
+    TEST_ASSERT_EQUAL_INT(16, span_len[0]);
+}
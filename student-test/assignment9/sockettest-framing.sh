@@ -0,0 +1,107 @@
+#!/bin/sh
+# Prueba a nivel de socket del troceado de paquetes y de AESDCHAR_IOCSEEKTO.
+#
+# Arranca su propio aesdsocket en el puerto 9000 con el almacén en proceso
+# (-s mmap), que no necesita el driver y empieza con el historial vacío, y
+# comprueba la respuesta a:
+#   - varios comandos en un mismo paquete
+#   - un comando partido en varios paquetes
+#   - AESDCHAR_IOCSEEKTO solo, detrás de un comando y partido
+#   - AESDCHAR_IOCSEEKTO a un comando que no existe
+#
+# Uso: sockettest-framing.sh [-b ruta/a/aesdsocket] [-e|-u]
+#   -b  binario del servidor (por defecto ../../server/aesdsocket)
+#   -e  modo epoll del servidor, -u modo io_uring
+
+cd `dirname $0`
+server=`pwd`/../../server/aesdsocket
+mode=
+port=9000
+timeout=2
+
+while getopts "b:eu" opt; do
+    case "$opt" in
+        b) server=$OPTARG ;;
+        e) mode=-e ;;
+        u) mode=-u ;;
+        *) echo "Usage: $0 [-b aesdsocket] [-e|-u]"; exit 1 ;;
+    esac
+done
+
+if [ ! -x "$server" ]; then
+    echo "$server not found, build it with make -C server"
+    exit 1
+fi
+
+tmpdir=`mktemp -d`
+pid=
+cleanup() {
+    if [ -n "$pid" ]; then
+        kill $pid 2>/dev/null
+        wait $pid 2>/dev/null
+    fi
+    rm -rf "$tmpdir"
+}
+trap cleanup EXIT
+trap 'exit 1' HUP INT PIPE TERM
+
+# -t 0: sin marcas de tiempo que se mezclen con lo esperado
+$server $mode -s mmap -f "$tmpdir/ring" -t 0 &
+pid=$!
+sleep 1
+# Si el puerto está ocupado se estaría probando otro servidor
+if ! kill -0 $pid 2>/dev/null; then
+    echo "$server failed to start"
+    pid=
+    exit 1
+fi
+
+failed=0
+
+# Envía la entrada estándar al servidor y guarda la respuesta en $1
+send() {
+    nc localhost ${port} -w ${timeout} > "$1"
+}
+
+# Compara la respuesta $2 con lo esperado en $3 (printf) para la prueba $1
+check() {
+    printf "$3" > "$tmpdir/expected"
+    if cmp -s "$tmpdir/expected" "$2"; then
+        echo "PASS: $1"
+    else
+        echo "FAIL: $1"
+        echo "  expected: `od -c "$tmpdir/expected" | head -5`"
+        echo "  received: `od -c "$2" | head -5`"
+        failed=1
+    fi
+}
+
+# Cada comando completo tiene su respuesta, aunque lleguen en el mismo paquete
+printf 'one\ntwo\n' | send "$tmpdir/got"
+check "two commands in one packet" "$tmpdir/got" 'one\none\ntwo\n'
+
+{ printf 'thr'; sleep 1; printf 'ee\n'; } | send "$tmpdir/got"
+check "command split across packets" "$tmpdir/got" 'one\ntwo\nthree\n'
+
+printf 'AESDCHAR_IOCSEEKTO:1,1\n' | send "$tmpdir/got"
+check "seekto" "$tmpdir/got" 'wo\nthree\n'
+
+printf 'four\nAESDCHAR_IOCSEEKTO:3,0\n' | send "$tmpdir/got"
+check "command and seekto in one packet" "$tmpdir/got" 'one\ntwo\nthree\nfour\nfour\n'
+
+{ printf 'AESDCHAR_IOC'; sleep 1; printf 'SEEKTO:2,3\n'; } | send "$tmpdir/got"
+check "seekto split across packets" "$tmpdir/got" 'ee\nfour\n'
+
+printf 'AESDCHAR_IOCSEEKTO:9,0\n' | send "$tmpdir/got"
+check "seekto past the last command" "$tmpdir/got" ''
+
+# El seekto no válido no se guarda como comando
+printf 'five\n' | send "$tmpdir/got"
+check "history after seekto" "$tmpdir/got" 'one\ntwo\nthree\nfour\nfive\n'
+
+if [ $failed -ne 0 ]; then
+    echo "Socket framing test failed"
+    exit 1
+fi
+echo "Socket framing test complete with success"
+exit 0